@@ -34,3 +34,8 @@ nmap('i', "n_i");
 nmap('a', "n_a");
 nmap('I', "n_I");
 nmap('A', "n_A");
+nmap('x', "n_x");
+nmap('G', "goto");
+nmap('.', "repeat");
+nmap('q', "macro record");
+nmap('@', "macro play");
@@ -1,67 +1,288 @@
-void handle_command(const std::string &command)
+// last command that changed the buffer, for "."
+struct change
 {
+	std::string command;
+	int count;
+	std::string text; // typed after command entered insert mode
+};
+thread_local change last_change;
+
+// Text typed in insert mode, which becomes the last change on leaving it.
+// Typing anywhere but where it ends starts it over.
+struct insert_state
+{
+	std::string command; // the one that entered insert mode
+	std::string text;
+	int line = -1;
+	size_t end = 0;
+
+	void start(const std::string &_command)
+	{
+		command = _command;
+		text.clear();
+		line = -1;
+	}
+	// after n bytes were inserted before the cursor
+	void typed(const char *s, size_t n)
+	{
+		if (buf->cursor != line || buf->cursor_x - n != end)
+			text.clear();
+		text.append(s, n);
+		line = buf->cursor;
+		end = buf->cursor_x;
+	}
+	// after a backspace
+	void erased()
+	{
+		if (buf->cursor != line || buf->cursor_x > end)
+			return;
+		text.resize(text.size() - std::min(text.size(), end - buf->cursor_x));
+		end = buf->cursor_x;
+	}
+};
+thread_local insert_state insertion;
+
+// Parse a line address (N, . or $) at pos into a 0-based line number.
+static bool parse_address(const std::string &command, size_t &pos, int &line)
+{
+	if (pos >= command.size())
+		return false;
+	char c = command[pos];
+	if (std::isdigit(c)) {
+		line = 0;
+		for (; pos < command.size() && std::isdigit(command[pos]); pos++)
+			line = std::min(line * 10 + (command[pos] - '0'), max_count);
+		line--;
+	} else if (c == '.' || c == '$') {
+		line = c == '.' ? buf->cursor : (int)buf->chars.size() - 1;
+		pos++;
+	} else if (c == '\'' && pos + 1 < command.size() && (command[pos + 1] == '<' || command[pos + 1] == '>')) {
+		throw std::invalid_argument("no visual selection");
+	} else {
+		return false;
+	}
+	return true;
+}
+
+// Parse % or address[,address] at pos.
+static bool parse_range(const std::string &command, size_t &pos, int &first, int &last)
+{
+	if (pos < command.size() && command[pos] == '%') {
+		pos++;
+		first = 0;
+		last = (int)buf->chars.size() - 1;
+		return true;
+	}
+	if (!parse_address(command, pos, first))
+		return false;
+	last = first;
+	if (pos < command.size() && command[pos] == ',' && !parse_address(command, ++pos, last))
+		throw std::invalid_argument("bad range");
+	if (first > last)
+		std::swap(first, last);
+	return true;
+}
+
+// count is the prefix typed before the key, 0 if there was none
+void handle_command(const std::string &command, int count = 0)
+{
+	size_t pos = 0;
+	int first, last;
+	if (parse_range(command, pos, first, last)) {
+		if (pos < command.size() && command[pos] == '!') {
+			// :{range}!command
+			latency.count_command("!");
+			buf->filter(first, last, command.substr(pos + 1));
+			win.update();
+		} else if (pos == command.size()) {
+			// :N goes to line N
+			latency.count_command("goto");
+			buf->go_to(last);
+			win.update_file();
+		} else {
+			throw std::invalid_argument("trailing characters: " + command.substr(pos));
+		}
+		return;
+	}
+
 	std::istringstream args(command);
 	std::string arg0, arg1;
 	args >> arg0;
+	latency.count_command(arg0);
 	if (arg0 == "q" || arg0 == "quit") {
-		exit(0);
+		throw quit_request();
 	} else if (arg0 == "r") {
 		std::string filename;
-		if (args >> filename)
-			buf.r(filename);
+		if ((args >> std::ws).peek() == '!') {
+			// :r !command inserts its output below the cursor
+			std::getline(args, filename);
+			int below = buf->cursor + 1;
+			buf->filter(below, below - 1, filename.substr(1));
+			win.update();
+		} else if (args >> filename)
+			buf->r(filename);
 		else
-			buf.r();
+			buf->r();
 		win.update_file();
 	} else if (arg0 == "w") {
 		std::string filename;
 		if (args >> filename)
-			buf.w(filename);
+			buf->w(filename);
 		else
-			buf.w();
+			buf->w();
+		win.update_status();
 	} else if (arg0 == "wq") {
-		buf.w();
-		exit(0);
-	} else if (arg0 == "o" || arg0 == "e") {
+		buf->w();
+		throw quit_request();
+	} else if (arg0 == "e") {
+		std::string filename;
+		if (!(args >> filename))
+			throw std::invalid_argument(":e needs an argument");
+		buffers.open(filename);
+		win.update();
+	} else if (arg0 == "b" || arg0 == "bn" || arg0 == "bp") {
+		size_t n = buffers.index(*buf);
+		if (arg0 == "bn")
+			n = (n + 1) % buffers.size();
+		else if (arg0 == "bp")
+			n = (n + buffers.size() - 1) % buffers.size();
+		else if (!(args >> n) || n-- == 0)
+			throw std::invalid_argument(":b needs a buffer number");
+		buffers.select(buffers.at(n));
+		win.update();
+	} else if (arg0 == "ls") {
+		static const char *const states[] = {"", "dropped", "compressed"};
+		std::vector<std::string> lines;
+		char line[256];
+		size_t n = 0, total = 0;
+		for (buffer &b : buffers) {
+			std::snprintf(line, sizeof(line), "%3zu %c%c %-40s %10zu bytes %s", ++n,
+			              &b == buf ? '%' : ' ', b.modified ? '+' : ' ',
+			              b.filename.empty() ? "Untitled" : b.filename.c_str(),
+			              b.footprint(), states[(int)b.state]);
+			lines.push_back(line);
+			total += b.footprint();
+		}
+		std::snprintf(line, sizeof(line), "%zu of %zu MiB budget in use", total >> 20, buffers.budget >> 20);
+		lines.push_back(line);
+		win.report(lines);
+	} else if (arg0 == "o") {
 		std::string filename;
 		if (args >> filename)
-			buf.o(filename);
+			buf->o(filename);
 		else
-			buf.o();
+			buf->o();
 		win.update_file();
 		win.update_status();
 	} else if (arg0 == "saveas") {
 		std::string filename;
 		if (args >> filename)
-			buf.saveas(filename);
+			buf->saveas(filename);
 		else
-			buf.saveas();
+			buf->saveas();
 		win.update_status();
 	} else if (arg0 == "cursor") {
 		std::string direction;
 		if (!(args >> direction))
 			throw std::invalid_argument(":cursor needs an argument");
-		if (direction == "left" && buf.cursor_x > 0)
-			buf.cursor_x--;
-		else if (direction == "right" && buf.cursor_x < buf.cursor->second.size() - 1 - (mode == mode_type::NORMAL))
-			buf.cursor_x++;
-		else if (direction == "up" && buf.cursor != buf.chars.begin()) {
-			--buf.cursor;
-			buf.adjust_start();
-		} else if (direction == "down") {
-			++buf.cursor;
-			if (buf.cursor == buf.chars.end())
-				--buf.cursor;
-			buf.adjust_start();
-		}
+		long n = std::max(count, 1);
+		size_t right_end = mode == mode_type::NORMAL ? buf->last_char() : buf->eol();
+		if (direction == "left")
+			buf->cursor_x = buf->advance(buf->cursor_x, -n);
+		else if (direction == "right" && buf->cursor_x < right_end)
+			buf->cursor_x = std::min(buf->advance(buf->cursor_x, n), right_end);
+		else if (direction == "up")
+			buf->go_to(buf->cursor - (int)n);
+		else if (direction == "down")
+			buf->go_to(buf->cursor + (int)n);
 		win.update_file();
-	} else if (arg0 == "0") {
-		buf.cursor = buf.chars.begin();
-		win.update_file();
-	} else if (arg0 == "100") {
-		buf.cursor = buf.chars.find(100);
-		if (buf.cursor == buf.chars.end())
-			buf.cursor = --buf.chars.upper_bound(100);
+	} else if (arg0 == "goto") {
+		// [count]G: line count, or the last line without one
+		buf->go_to(count ? count - 1 : (int)buf->chars.size() - 1);
 		win.update_file();
+	} else if (arg0 == "repeat") {
+		if (last_change.command.empty())
+			return;
+		if (last_change.text.empty()) {
+			handle_command(last_change.command, count ? count : last_change.count);
+			return;
+		}
+		// an insert: enter it the same way and type count copies at once
+		handle_command(last_change.command);
+		std::string text;
+		for (int n = std::max(count, 1); n > 0; n--)
+			text += last_change.text;
+		buf->insert(text.data(), text.size());
+		handle_command("misc escape");
+	} else if (arg0 == "stats") {
+		std::vector<std::string> lines;
+		char line[128];
+		std::snprintf(line, sizeof(line), "%-10s %10s %10s %10s %10s", "phase", "count", "p50", "p99", "max");
+		lines.push_back(line);
+		for (int p = 0; p < (int)iv::phase::COUNT; p++) {
+			const iv::histogram &h = latency[(iv::phase)p];
+			std::snprintf(line, sizeof(line), "%-10s %10llu %10s %10s %10s", iv::phase_names[p],
+			              (unsigned long long)h.count(),
+			              iv::format_duration(h.percentile(0.5)).c_str(),
+			              iv::format_duration(h.percentile(0.99)).c_str(),
+			              iv::format_duration(h.max()).c_str());
+			lines.push_back(line);
+		}
+		lines.push_back("");
+		for (auto &c : latency.command_counts()) {
+			std::snprintf(line, sizeof(line), "%-21s %10llu", c.first.c_str(), (unsigned long long)c.second);
+			lines.push_back(line);
+		}
+		win.report(lines);
+	} else if (arg0 == "memstats") {
+		std::string filename;
+		if (args >> filename) {
+			std::ofstream stream(filename);
+			stream.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+			for (iv::mem_counter *c : iv::mem::all)
+				stream << c->name << '\t' << c->objects << '\t' << c->bytes << '\n';
+		} else {
+			std::vector<std::string> lines;
+			char line[128];
+			std::snprintf(line, sizeof(line), "%-12s %12s %14s", "kind", "objects", "bytes");
+			lines.push_back(line);
+			for (iv::mem_counter *c : iv::mem::all) {
+				std::snprintf(line, sizeof(line), "%-12s %12ld %14ld", c->name, c->objects.load(), c->bytes.load());
+				lines.push_back(line);
+			}
+			win.report(lines);
+		}
+	} else if (arg0 == "macro") {
+		std::string action;
+		if (!(args >> action))
+			throw std::invalid_argument(":macro needs an argument");
+		if (action == "record" && macros.recording) {
+			// drop the key that stopped the recording
+			auto &keys = macros.registers[macros.recording];
+			if (!keys.empty())
+				keys.pop_back();
+			macros.recording = 0;
+			win.update_status();
+		} else if (action == "record") {
+			pending_key = [](int reg) {
+				if (reg >= 256 || !std::isalnum(reg))
+					throw std::invalid_argument("invalid register");
+				macros.registers[reg].clear();
+				macros.recording = reg;
+				win.update_status();
+			};
+		} else if (action == "play") {
+			pending_key = [count](int reg) {
+				replay_macro(reg, count);
+			};
+		}
+	} else if (arg0 == "follow") {
+		buf->follow = !buf->follow;
+		if (buf->follow) {
+			buf->go_to((int)buf->chars.size() - 1);
+			win.update_file();
+		}
+		win.message(buf->follow ? "following " + buf->filename : "not following");
 	} else if (arg0 == "refresh") {
 		win.update();
 	} else if (arg0 == "mode") {
@@ -72,15 +293,17 @@ void handle_command(const std::string &command)
 			                           mode_type::COMMAND;
 			if (mode == mode_type::COMMAND)
 				win.command = std::string();
+			if (mode == mode_type::INSERT)
+				insertion.start("n_i");
 			win.update();
 		}
 	} else if (arg0 == "page") {
 		std::string direction;
 		if (args >> direction) {
 			if (direction == "up") {
-				buf.set_start(std::max(0, buf.start->first - LINES + 2));
+				buf->set_start(std::max(0, buf->start - page_size()));
 			} else if (direction == "down") {
-				buf.set_start(buf.start->first + LINES - 2);
+				buf->set_start(buf->start + page_size());
 			}
 			win.update_file();
 		}
@@ -88,41 +311,52 @@ void handle_command(const std::string &command)
 		std::string direction;
 		if (args >> direction) {
 			if (direction == "up") {
-				buf.set_start(std::max(0, buf.start->first - LINES / 2 + 1));
+				buf->set_start(std::max(0, buf->start - page_size() / 2));
 			} else if (direction == "down") {
-				buf.set_start(buf.start->first + LINES / 2 - 1);
+				buf->set_start(buf->start + page_size() / 2);
 			}
 			win.update_file();
 		}
 	} else if (arg0 == "n_0") {
-		buf.cursor_x = 0;
+		buf->cursor_x = 0;
 		win.update_file();
 	} else if (arg0 == "n_$") {
-		buf.cursor_x = buf.cursor->second.size() - 2;
+		buf->cursor_x = buf->last_char();
+		win.update_file();
+	} else if (arg0 == "n_x") {
+		last_change = {command, count};
+		buf->erase(std::max(count, 1));
+		buf->cursor_x = std::min(buf->cursor_x, buf->last_char());
 		win.update_file();
 	} else if (arg0 == "n_i") {
-		buf.cursor_x = std::min(buf.cursor->second.size() - 1, buf.cursor_x);
+		buf->cursor_x = std::min(buf->eol(), buf->cursor_x);
 		mode = mode_type::INSERT;
+		insertion.start(arg0);
 		win.update();
 	} else if (arg0 == "n_a") {
-		buf.cursor_x = std::min(buf.cursor->second.size() - 1, buf.cursor_x + 1);
+		buf->cursor_x = buf->advance(buf->cursor_x, 1);
 		mode = mode_type::INSERT;
+		insertion.start(arg0);
 		win.update();
 	} else if (arg0 == "n_I") {
-		buf.cursor_x = 0;
+		buf->cursor_x = 0;
 		mode = mode_type::INSERT;
+		insertion.start(arg0);
 		win.update();
 	} else if (arg0 == "n_A") {
-		buf.cursor_x = buf.cursor->second.size() - 1;
+		buf->cursor_x = buf->eol();
 		mode = mode_type::INSERT;
+		insertion.start(arg0);
 		win.update();
 	} else if (arg0 != "misc") {
 		throw std::invalid_argument("unknown command: " + arg0);
 	} else if (!(args >> arg1)) {
 		throw std::invalid_argument("need argument: " + arg0);
 	} else if (arg1 == "i:backspace") {
-		if (buf.cursor_x > 0) {
-			buf.cursor->second.erase(buf.cursor_x--, 1);
+		if (buf->cursor_x > 0) {
+			buf->cursor_x = buf->advance(buf->cursor_x, -1);
+			buf->erase(1);
+			insertion.erased();
 			win.update_file();
 		}
 	} else if (arg1 == "c:backspace") {
@@ -133,14 +367,16 @@ void handle_command(const std::string &command)
 		win.update_cmdline();
 		win.activate_window();
 	} else if (arg1 == "escape") {
-		if (mode == mode_type::INSERT)
-			buf.cursor_x = std::min((int)buf.cursor->second.size() - 2, std::max((int)buf.cursor_x, 1) - 1);
+		if (mode == mode_type::INSERT) {
+			if (!insertion.text.empty())
+				last_change = {insertion.command, 1, insertion.text};
+			buf->cursor_x = std::min(buf->advance(buf->cursor_x, -1), buf->last_char());
+		}
 		mode = mode_type::NORMAL;
 		win.update();
 	} else if (arg1 == "c:return") {
 		mode = mode_type::NORMAL;
-		wclear(win.cmdline);
-		wrefresh(win.cmdline);
+		win.update_cmdline();
 		handle_command(win.command);
 	}
 }
@@ -1,6 +1,12 @@
 #include <algorithm>
+#include <atomic>
 #include <cctype> /* isprint */
+#include <cerrno>
+#include <clocale>
+#include <condition_variable>
 #include <cstdlib> /* exit() */
+#include <cstring>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <initializer_list>
@@ -8,90 +14,436 @@
 #include <iterator>
 #include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <utility>
+#include <vector>
+#include <getopt.h>
 #include <ncurses.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "lines.h"
 #include "list.h"
+#include "memstats.h"
+#include "process.h"
+#include "stats.h"
+#include "utf8.h"
+#include "watch.h"
 
 #ifndef CTRL
 #define CTRL(c) ((c) & 037)
 #endif
 
 const int tab_size = 8;
+// Loading expands tabs, since drawing takes every byte for one column.
+// Headless mode draws nothing and keeps them, so that the files it
+// writes back change only where they were edited.
+bool expand_tabs = true;
+
+thread_local iv::latency_recorder latency;
+
+// Set while working on behalf of a remote client, see server.cpp.
+thread_local int view_lines = 0;
+
+// Number of text lines the file window shows; 1 when there is no terminal.
+static int page_size()
+{
+	return view_lines ? view_lines : std::max(LINES - 2, 1);
+}
+
+// Thrown by :q and :wq; unwinds to whoever drives the editor.
+struct quit_request {};
 
 struct buffer
 {
-	typedef std::map<int, std::string> chars_type;
-	chars_type chars;
-	chars_type::iterator start, cursor;
+	iv::line_store chars;
+	int start = 0, cursor = 0; // line numbers
 	size_t cursor_x;
 	std::string filename;
+	// how much of filename, identified by inode, the buffer holds; stale
+	// once the file was truncated or replaced and only a reload helps
+	std::streamoff loaded = 0;
+	ino_t inode = 0;
+	bool stale = true;
+	bool follow = false; // keep the cursor on the last line as the file grows
+	bool modified = false;
 
-	buffer() : chars(), start(chars.begin()), cursor(chars.begin()) {}
+	// Cold buffers give up their lines: ones whose file still holds their
+	// text are re-read from disk when used again, the others are kept zlib
+	// compressed.
+	enum class residency { RESIDENT, DROPPED, COMPRESSED } state = residency::RESIDENT;
+	std::string packed; // compressed text while COMPRESSED
+	size_t packed_size = 0;
+	int saved_cursor = 0, saved_start = 0; // cursor position while spilled
+	size_t saved_cursor_x = 0;
+	unsigned long last_used = 0;
+
+	// What drawing needs to know about a line, cached until it changes.
+	struct line_info
+	{
+		bool ascii;
+		int width; // display columns
+	};
+	mutable std::unordered_map<int, line_info> widths;
+
+	// There is always at least one line, so the cursor always has one
+	// to be on; an empty buffer holds a single empty, unterminated line.
+	buffer()
+	{
+		clear();
+	}
 	buffer(const std::string _filename) : filename(_filename)
 	{
 		r();
 	}
 
-	template <class Iterator>
-	void assign(Iterator begin, Iterator end)
+	void clear()
 	{
 		chars.clear();
-		std::string *line = NULL;
-		auto push = [this, &line](char c) {
-			if (line == NULL)
-				line = &chars.insert(std::make_pair(chars.size(), std::string())).first->second;
-			line->push_back(c);
-		};
-		for (; begin != end; ++begin) {
-			switch (*begin) {
-			case '\t':
-				for (int i = 0; i < tab_size; i++)
-					push(' ');
-				break;
-			case '\n':
-				push(*begin);
-				line = NULL;
-				break;
-			default:
-				push(*begin);
-				break;
+		chars.push_back();
+		widths.clear();
+		start = cursor = 0;
+		cursor_x = 0;
+	}
+
+	// Add text at the end, continuing the last line if it is unterminated.
+	// Runs of plain characters are copied into the line store in one go.
+	void append(const char *text, size_t n)
+	{
+		const char *end = text + n;
+		bool open = !terminated(chars.size() - 1);
+		if (open)
+			widths.erase(chars.size() - 1);
+		while (text < end) {
+			if (!open)
+				chars.push_back();
+			open = true;
+			const char *run = text;
+			while (text < end && *text != '\n' && (*text != '\t' || !expand_tabs))
+				text++;
+			if (text < end && *text == '\n') {
+				text++;
+				open = false;
+			}
+			chars.append(chars.size() - 1, run, text - run);
+			if (expand_tabs && text < end && *text == '\t') {
+				chars.append(chars.size() - 1, "        ", tab_size);
+				text++;
 			}
 		}
-		start = cursor = chars.begin();
-		cursor_x = 0;
 	}
 
+	void append(std::istream &stream)
+	{
+		char chunk[1 << 16];
+		std::streamsize n;
+		while ((n = stream.rdbuf()->sgetn(chunk, sizeof(chunk))) > 0)
+			append(chunk, n);
+	}
+
+	bool terminated(int n) const
+	{
+		std::string_view line = chars[n];
+		return !line.empty() && line.back() == '\n';
+	}
+
+	// True for the single empty line of an empty buffer.
+	bool blank() const
+	{
+		return chars.size() == 1 && chars[0].empty();
+	}
+
+	// Scroll just enough to bring the cursor into view.
 	void adjust_start()
 	{
-		while (cursor->first >= start->first + LINES - 2)
-			++start;
-		while (cursor->first < start->first)
-			--start;
+		if (cursor >= start + page_size())
+			start = cursor - page_size() + 1;
+		else if (cursor < start)
+			start = cursor;
+	}
+
+	// Move the cursor to line n, clamped to the buffer.
+	void go_to(int n)
+	{
+		cursor = std::max(std::min(n, (int)chars.size() - 1), 0);
+		// don't land in the middle of a multibyte character
+		std::string_view line = chars[cursor];
+		while (cursor_x > 0 && cursor_x < line.size() && iv::utf8::is_continuation(line[cursor_x]))
+			cursor_x--;
+		adjust_start();
+	}
+
+	const line_info &info(int n) const
+	{
+		auto i = widths.find(n);
+		if (i != widths.end())
+			return i->second;
+		if (widths.size() >= 65536)
+			widths.clear();
+		std::string_view text = chars[n];
+		line_info li;
+		li.ascii = iv::utf8::is_ascii(text.data(), text.size());
+		li.width = li.ascii ? text.size() - (!text.empty() && text.back() == '\n')
+		                    : iv::utf8::columns(text.data(), text.size());
+		return widths[n] = li;
+	}
+
+	// Byte offset of the cursor line's newline (or its end).
+	size_t eol() const
+	{
+		std::string_view line = chars[cursor];
+		return line.size() - terminated(cursor);
+	}
+
+	// Byte offset n characters after (n < 0: before) x on the cursor line.
+	size_t advance(size_t x, long n) const
+	{
+		std::string_view line = chars[cursor];
+		if (info(cursor).ascii)
+			return n < 0 ? x - std::min((size_t)-n, x) : std::min(x + n, eol());
+		for (; n < 0 && x > 0; n++)
+			x = iv::utf8::prev(line.data(), x);
+		for (; n > 0 && x < eol(); n--)
+			x = iv::utf8::next(line.data(), eol(), x);
+		return x;
+	}
+
+	// Start of the last character before the newline.
+	size_t last_char() const
+	{
+		return advance(eol(), -1);
+	}
+
+	int cursor_column() const
+	{
+		std::string_view line = chars[cursor];
+		if (info(cursor).ascii)
+			return cursor_x;
+		return iv::utf8::columns(line.data(), std::min(cursor_x, line.size()));
+	}
+
+	// Insert text before cursor_x and move past it.
+	void insert(const char *text, size_t n)
+	{
+		iv::scoped_timer timer(latency, iv::phase::MUTATE);
+		widths.erase(cursor);
+		chars.insert(cursor, cursor_x, text, n);
+		cursor_x += n;
+		modified = true;
+	}
+
+	// Remove up to n characters at cursor_x, but not the line's newline.
+	void erase(size_t n)
+	{
+		iv::scoped_timer timer(latency, iv::phase::MUTATE);
+		if (cursor_x < eol()) {
+			n = advance(cursor_x, n) - cursor_x;
+			widths.erase(cursor);
+			chars.erase(cursor, cursor_x, n);
+			modified = true;
+		}
+	}
+
+	/*
+	 * Replace lines first..last with the output of command run on them;
+	 * with last < first nothing is replaced and the output is inserted
+	 * before line first.  The lines are written straight out of the line
+	 * store in writev() batches while the output is read as it arrives
+	 * into a store of its own, whose blocks are then spliced in without
+	 * copying the text again.  If the command fails, the buffer is left
+	 * alone.
+	 */
+	void filter(int first, int last, const std::string &command)
+	{
+		iv::child_process child(command);
+		int end = std::min(last + 1, (int)chars.size());
+		int line = last < first ? end : std::max(first, 0);
+		size_t offset = 0; // bytes of line already written
+		buffer output;
+		char chunk[1 << 16];
+		iovec iov[1024];
+		if (line >= end)
+			child.close_input();
+		while (child.output() >= 0) {
+			pollfd fds[] = {{child.output(), POLLIN, 0}, {child.input(), POLLOUT, 0}};
+			if (poll(fds, 2, -1) < 0) {
+				if (errno == EINTR)
+					continue;
+				throw std::runtime_error(std::string("poll: ") + std::strerror(errno));
+			}
+			if (fds[1].revents) {
+				int n = 0;
+				for (int i = line; i < end && n < 1024; i++, n++) {
+					std::string_view text = chars[i];
+					size_t skip = n == 0 ? offset : 0;
+					iov[n].iov_base = const_cast<char *>(text.data()) + skip;
+					iov[n].iov_len = text.size() - skip;
+				}
+				ssize_t written = writev(child.input(), iov, n);
+				if (written < 0 && errno != EAGAIN && errno != EINTR)
+					child.close_input(); // the command stopped reading
+				for (; written >= 0 && line < end; line++, offset = 0) {
+					size_t size = chars[line].size();
+					if ((size_t)written < size - offset) {
+						offset += written;
+						break;
+					}
+					written -= size - offset;
+				}
+				if (line >= end)
+					child.close_input();
+			}
+			if (fds[0].revents) {
+				ssize_t n = ::read(child.output(), chunk, sizeof(chunk));
+				if (n > 0)
+					output.append(chunk, n);
+				else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+					child.close_output();
+			}
+		}
+		int status = child.wait();
+		if (status != 0) {
+			std::string why(output.chars[0]);
+			if (!why.empty() && why.back() == '\n')
+				why.pop_back();
+			throw std::runtime_error(why.empty() ? "command failed: " + command : why);
+		}
+		replace_lines(first, last, output.chars);
+	}
+
+	// Put the lines of another store in place of lines first..last.
+	void replace_lines(int first, int last, iv::line_store &lines)
+	{
+		iv::scoped_timer timer(latency, iv::phase::MUTATE);
+		if (lines.size() == 1 && lines[0].empty())
+			lines.clear(); // no output at all
+		else if (!lines.empty() && lines.back().back() != '\n')
+			lines.append(lines.size() - 1, "\n", 1);
+		if (blank()) {
+			// the empty line of an empty buffer makes way for the text
+			first = last = 0;
+		} else if (first >= (int)chars.size() && !terminated(chars.size() - 1)) {
+			chars.append(chars.size() - 1, "\n", 1);
+		}
+		first = std::min(std::max(first, 0), (int)chars.size());
+		int count = std::max(std::min(last + 1, (int)chars.size()) - first, 0);
+		chars.splice(first, count, lines);
+		if (chars.empty())
+			chars.push_back();
+		widths.clear();
+		modified = true;
+		start = std::min(start, (int)chars.size() - 1);
+		cursor_x = 0;
+		go_to(first);
+	}
+
+	// Approximate memory held by the buffer.
+	size_t footprint() const
+	{
+		if (state != residency::RESIDENT)
+			return packed.size();
+		return chars.memory();
+	}
+
+	// True if filename still starts with the text loaded from it: the same
+	// inode, at least as long (a followed log only grows), not stale.
+	bool matches_disk() const
+	{
+		struct stat st;
+		return !stale && ::stat(filename.c_str(), &st) == 0 && st.st_ino == inode && st.st_size >= loaded;
+	}
+
+	void spill()
+	{
+		if (state != residency::RESIDENT)
+			return;
+		saved_cursor = cursor;
+		saved_start = start;
+		saved_cursor_x = cursor_x;
+		if (modified || !matches_disk()) {
+			std::ostringstream stream;
+			write(stream);
+			const std::string &text = stream.str();
+			uLongf size = compressBound(text.size());
+			packed.resize(size);
+			if (compress2((Bytef *)&packed[0], &size, (const Bytef *)text.data(), text.size(), Z_BEST_SPEED) != Z_OK)
+				return;
+			packed.resize(size);
+			packed.shrink_to_fit();
+			packed_size = text.size();
+			state = residency::COMPRESSED;
+		} else {
+			state = residency::DROPPED;
+		}
+		clear();
+	}
+
+	// Bring the lines back.  Returns false if the file of a dropped buffer
+	// changed meanwhile, in which case what is on disk now was loaded.
+	bool materialize()
+	{
+		if (state == residency::RESIDENT)
+			return true;
+		bool intact = true;
+		if (state == residency::DROPPED) {
+			intact = matches_disk();
+			r();
+		} else {
+			std::string text(packed_size, '\0');
+			uLongf size = packed_size;
+			if (uncompress((Bytef *)&text[0], &size, (const Bytef *)packed.data(), packed.size()) != Z_OK)
+				throw std::runtime_error("cannot decompress " + filename);
+			clear();
+			append(text.data(), text.size());
+			std::string().swap(packed);
+		}
+		state = residency::RESIDENT;
+		start = std::min(saved_start, (int)chars.size() - 1);
+		go_to(saved_cursor);
+		cursor_x = std::min(saved_cursor_x, eol());
+		return intact;
 	}
 
 	void set_start(int _start)
 	{
-		start = --chars.upper_bound(_start);
-		while (cursor->first >= start->first + LINES - 2)
-			--cursor;
-		while (cursor->first < start->first)
-			++cursor;
+		start = std::min(_start, (int)chars.size() - 1);
+		cursor = std::max(std::min(cursor, start + page_size() - 1), start);
 	}
 
 	void read(std::istream &stream)
 	{
-		assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+		clear();
+		append(stream);
 	}
 
 	void write(std::ostream &stream)
 	{
-		for (auto c : chars)
-			stream << c.second;
+		for (size_t i = 0; i < chars.size(); i++)
+			stream << chars[i];
+	}
+
+	// Remember that the first size bytes of _filename are what we hold.
+	void track(const std::string &_filename, std::streamoff size)
+	{
+		struct stat st;
+		stale = _filename != filename || ::stat(filename.c_str(), &st) != 0;
+		if (!stale) {
+			loaded = size;
+			inode = st.st_ino;
+		}
 	}
 
 	void r(std::string _filename = std::string())
@@ -101,6 +453,18 @@ struct buffer
 		std::ifstream stream(_filename);
 		stream.exceptions(std::ifstream::failbit | std::ifstream::badbit);
 		read(stream);
+		track(_filename, stream.tellg());
+		modified = false;
+	}
+
+	// Read only what was appended to the file since it was loaded.
+	void r_tail(std::streamoff size)
+	{
+		std::ifstream stream(filename);
+		stream.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+		stream.seekg(loaded);
+		append(stream);
+		loaded = std::max(size, (std::streamoff)stream.tellg());
 	}
 
 	void o(const std::string &_filename = std::string())
@@ -111,6 +475,8 @@ struct buffer
 		stream.exceptions(std::ifstream::failbit | std::ifstream::badbit);
 		read(stream);
 		filename = _filename;
+		track(filename, stream.tellg());
+		modified = false;
 	}
 
 	void w(std::string _filename = std::string())
@@ -120,6 +486,10 @@ struct buffer
 		std::ofstream stream(_filename);
 		stream.exceptions(std::ifstream::failbit | std::ifstream::badbit);
 		write(stream);
+		if (_filename == filename) {
+			track(filename, stream.tellp());
+			modified = false;
+		}
 	}
 
 	void saveas(const std::string &_filename = std::string())
@@ -130,43 +500,158 @@ struct buffer
 		stream.exceptions(std::ifstream::failbit | std::ifstream::badbit);
 		write(stream);
 		filename = _filename;
+		track(filename, stream.tellp());
+		modified = false;
 	}
-} buf;
+};
+
+/*
+ * All open buffers, in the order they were opened.  Whenever a buffer is
+ * selected, least recently used ones are spilled until the resident
+ * buffers fit into the budget (IV_BUFFER_BUDGET MiB, default 1024).
+ */
+struct buffer_list : public std::list<buffer>
+{
+	size_t budget;
+	unsigned long clock = 0;
+
+	buffer_list()
+	{
+		const char *mib = std::getenv("IV_BUFFER_BUDGET");
+		budget = (mib ? std::strtoul(mib, NULL, 10) : 1024) << 20;
+	}
+
+	buffer &select(buffer &b);
+	buffer &open(const std::string &filename);
+	buffer &at(size_t n);
+	size_t index(const buffer &b) const;
+	void enforce_budget(const buffer &keep);
+};
+
+// Per thread so that headless workers (-s) each edit their own buffers.
+thread_local buffer_list buffers;
+thread_local buffer *buf;
+
+// Switch to the buffer holding filename, loading it if necessary.
+buffer &buffer_list::open(const std::string &filename)
+{
+	for (buffer &b : *this)
+		if (b.filename == filename)
+			return select(b);
+	if (buf && buf->filename.empty() && !buf->modified) {
+		buf->o(filename);
+		return select(*buf);
+	}
+	emplace_back();
+	try {
+		back().o(filename);
+	} catch (...) {
+		pop_back();
+		throw;
+	}
+	return select(back());
+}
+
+buffer &buffer_list::at(size_t n)
+{
+	if (n >= size())
+		throw std::invalid_argument("no buffer " + std::to_string(n + 1));
+	return *std::next(begin(), n);
+}
+
+size_t buffer_list::index(const buffer &b) const
+{
+	size_t n = 0;
+	for (auto i = begin(); &*i != &b; ++i)
+		n++;
+	return n;
+}
+
+void buffer_list::enforce_budget(const buffer &keep)
+{
+	size_t total = 0;
+	for (buffer &b : *this)
+		total += b.footprint();
+	while (total > budget) {
+		buffer *victim = NULL;
+		for (buffer &b : *this)
+			if (&b != &keep && b.state == buffer::residency::RESIDENT
+			    && (!victim || b.last_used < victim->last_used))
+				victim = &b;
+		if (!victim)
+			break;
+		total -= victim->footprint();
+		victim->spill();
+		total += victim->footprint();
+	}
+}
 
 enum class mode_type {
 	NORMAL,
 	INSERT,
 	COMMAND
-} mode;
+};
 
-struct screen_initializer
+thread_local mode_type mode;
+
+// q{reg} records the keys typed into a register, [count]@{reg} replays them.
+struct macro_state
 {
-	screen_initializer() { initscr(); }
-};
+	std::map<int, std::vector<int>> registers;
+	int recording = 0; // register being recorded into, 0 if none
+	int last = 0; // register last replayed, for @@
+	int depth = 0; // nesting of replays in progress
+} macros;
 
-struct Window : public screen_initializer
+// Windows stay null until open(), and all drawing is a no-op until then,
+// so the editor core runs without a terminal in headless mode.
+struct Window
 {
 	WINDOW *file;
 	WINDOW *status;
 	WINDOW *cmdline;
 	std::string command;
+	int suppressed; // while non-zero nothing is drawn, see replay_macro()
+	// where messages and reports go when there is no terminal
+	std::function<void (const std::string &)> on_message;
+	std::function<void (const std::vector<std::string> &)> on_report;
 
 	Window();
 	~Window();
+	void open();
+	bool active() const { return file != nullptr; }
+	bool drawing() const { return active() && !suppressed; }
 	int input() { return wgetch(file); }
+	bool input_pending();
 	void update();
 	void update_file();
 	void update_status();
+	std::string status_text() const;
 	void update_cmdline();
 	void activate_window();
+	void flush();
+	void message(const std::string &text);
+	void report(const std::vector<std::string> &lines);
+	void flash();
 } win;
 
-Window::Window()
-	: screen_initializer(),
-	file(newwin(LINES - 2, COLS, 0, 0)),
-	status(newwin(1, COLS, LINES - 2, 0)),
-	cmdline(newwin(1, COLS, LINES - 1, 0))
+Window::Window() : file(nullptr), status(nullptr), cmdline(nullptr), suppressed(0)
+{
+}
+
+Window::~Window()
+{
+	if (active())
+		endwin();
+}
+
+void Window::open()
 {
+	std::setlocale(LC_ALL, "");
+	initscr();
+	file = newwin(LINES - 2, COLS, 0, 0);
+	status = newwin(1, COLS, LINES - 2, 0);
+	cmdline = newwin(1, COLS, LINES - 1, 0);
 	clear();
 	noecho();
 	cbreak();
@@ -174,18 +659,28 @@ Window::Window()
 		keypad(w, TRUE);
 }
 
-Window::~Window()
+static void activate(WINDOW *w)
 {
-	endwin();
+	wrefresh(w);
 }
 
-static void activate(WINDOW *w)
+// True if a key can be read without blocking.  ncurses may already hold
+// one that poll() cannot see, read ahead after an escape.
+bool Window::input_pending()
 {
-	wrefresh(w);
+	wtimeout(file, 0);
+	int c = wgetch(file);
+	wtimeout(file, -1);
+	if (c == ERR)
+		return false;
+	ungetch(c);
+	return true;
 }
 
 void Window::update()
 {
+	if (!drawing())
+		return;
 	clear();
 	update_file();
 	update_status();
@@ -193,41 +688,68 @@ void Window::update()
 	for (WINDOW *w: {file, status, cmdline})
 		wnoutrefresh(w);
 	activate_window();
+	iv::scoped_timer timer(latency, iv::phase::REFRESH);
 	doupdate();
 }
 
 void Window::update_file()
 {
-	wclear(file);
-	int line = buf.start->first;
-	for (buffer::chars_type::iterator i = buf.start; i != buf.chars.end(); i++) {
-		wmove(file, line++ - buf.start->first, 0);
-		waddnstr(file, i->second.c_str(), COLS);
+	if (!drawing())
+		return;
+	iv::scoped_timer timer(latency, iv::phase::RENDER);
+	werase(file);
+	int row = 0;
+	for (int i = buf->start; i < (int)buf->chars.size() && row < page_size(); i++) {
+		wmove(file, row++, 0);
+		const buffer::line_info &li = buf->info(i);
+		std::string_view line = buf->chars[i];
+		if (li.ascii)
+			waddnstr(file, line.data(), std::min<size_t>(line.size(), COLS));
+		else if (li.width <= COLS)
+			waddnstr(file, line.data(), line.size());
+		else
+			waddnstr(file, line.data(), iv::utf8::clip(line.data(), line.size(), COLS));
 	}
-	wmove(file, buf.cursor->first - buf.start->first, buf.cursor_x);
+	wmove(file, buf->cursor - buf->start, buf->cursor_column());
 }
 
 void Window::update_status()
 {
+	if (!drawing())
+		return;
 	wclear(status);
-	waddstr(status, buf.filename.empty() ? "Untitled" : buf.filename.c_str());
-	if (mode == mode_type::INSERT)
-		waddstr(status, " ---INSERT---");
+	waddstr(status, status_text().c_str());
 	wrefresh(status);
 }
 
+std::string Window::status_text() const
+{
+	std::string text = buf->filename.empty() ? "Untitled" : buf->filename;
+	if (buf->modified)
+		text += " [+]";
+	if (mode == mode_type::INSERT)
+		text += " ---INSERT---";
+	if (macros.recording)
+		text += std::string(" recording @") + (char)macros.recording;
+	return text;
+}
+
 void Window::update_cmdline()
 {
+	if (!drawing())
+		return;
 	wclear(cmdline);
 	if (mode == mode_type::COMMAND) {
-		wprintw(cmdline, ":");
-		wprintw(cmdline, command.c_str());
+		waddstr(cmdline, ":");
+		waddstr(cmdline, command.c_str());
 	}
 	wrefresh(cmdline);
 }
 
 void Window::activate_window()
 {
+	if (!drawing())
+		return;
 	switch (mode) {
 	case mode_type::NORMAL:
 		activate(file);
@@ -241,28 +763,102 @@ void Window::activate_window()
 	}
 }
 
+// Push pending changes of the file window to the terminal now rather than
+// in the next wgetch(), so that the cost is attributed to this keystroke.
+void Window::flush()
+{
+	if (drawing() && is_wintouched(file)) {
+		iv::scoped_timer timer(latency, iv::phase::REFRESH);
+		wrefresh(file);
+	}
+}
+
+void Window::message(const std::string &text)
+{
+	if (!active()) {
+		if (on_message)
+			on_message(text);
+		else
+			std::cerr << text << std::endl;
+		return;
+	}
+	if (!drawing())
+		return;
+	wclear(status);
+	waddstr(status, text.c_str());
+	wrefresh(status);
+}
+
+// Below the window, which it tells when a dropped buffer had to be reloaded.
+buffer &buffer_list::select(buffer &b)
+{
+	bool intact = b.materialize();
+	b.last_used = ++clock;
+	buf = &b;
+	enforce_budget(b);
+	if (!intact)
+		win.message(b.filename + " changed on disk while dropped, reloaded it");
+	return b;
+}
+
+void Window::flash()
+{
+	if (drawing())
+		::flash();
+}
+
+// Show a multi-line report over the file window until it is redrawn.
+void Window::report(const std::vector<std::string> &lines)
+{
+	if (!active() && on_report) {
+		on_report(lines);
+		return;
+	}
+	if (!active()) {
+		std::string text;
+		for (auto &line : lines)
+			text += line + '\n';
+		std::cout << text << std::flush;
+		return;
+	}
+	if (!drawing())
+		return;
+	wclear(file);
+	for (size_t i = 0; i < lines.size() && (int)i < LINES - 2; i++)
+		mvwaddnstr(file, i, 0, lines[i].c_str(), COLS);
+	wrefresh(file);
+}
+
+// largest count or line number accepted
+const int max_count = 100000000;
+
+// If set, the next key goes here instead of through the bindings.
+std::function<void (int)> pending_key;
+
+void replay_macro(int reg, int count);
+
 #include "handle_command.cpp"
 
 struct key_bindings
 {
-	typedef std::pair<const int, std::function<void ()>> binding;
+	typedef std::pair<const int, std::function<void (int)>> binding;
 	std::map<binding::first_type, binding::second_type> bindings;
 	key_bindings(const std::initializer_list<binding> &_bindings) : bindings(_bindings) { }
-	bool handle(int key);
+	bool handle(int key, int count = 0);
 	void add_command_binding(int key, const char *cmd);
 };
 
-bool key_bindings::handle(int key)
+bool key_bindings::handle(int key, int count)
 {
 	bool ret = bindings.count(key);
 	if (ret)
-		bindings[key]();
+		bindings[key](count);
 	return ret;
 }
 
 void key_bindings::add_command_binding(int key, const char *cmd)
 {
-	bindings.emplace(key, std::bind(handle_command, cmd));
+	bindings.emplace(key, std::bind(handle_command, std::string(cmd), std::placeholders::_1));
 }
 
 key_bindings any_bindings({});
@@ -271,35 +867,208 @@ key_bindings normal_bindings({});
 key_bindings insert_bindings({});
 key_bindings command_bindings({});
 
-void handle_key()
+// Printable ASCII, or a byte of a UTF-8 sequence.
+static bool is_text(int c)
+{
+	return c < 256 && (std::isprint(c) || c >= 0x80);
+}
+
+// count typed so far in normal mode, 0 if none
+int count_prefix = 0;
+
+void dispatch_key(int c)
 {
-	int c = win.input();
 	do {
-		if (any_bindings.handle(c))
+		if (pending_key) {
+			auto handler = std::move(pending_key);
+			pending_key = nullptr;
+			handler(c);
+			break;
+		}
+		if (mode == mode_type::NORMAL && c >= '0' && c <= '9' && (c != '0' || count_prefix)) {
+			count_prefix = std::min(count_prefix * 10 + (c - '0'), max_count);
 			break;
-		if (mode == mode_type::NORMAL && normal_bindings.handle(c))
+		}
+		int count = count_prefix;
+		count_prefix = 0;
+		if (any_bindings.handle(c, count))
 			break;
-		if (mode == mode_type::INSERT && insert_bindings.handle(c))
+		if (mode == mode_type::NORMAL && normal_bindings.handle(c, count))
 			break;
-		if (mode == mode_type::COMMAND && command_bindings.handle(c))
+		if (mode == mode_type::INSERT && insert_bindings.handle(c, count))
 			break;
-		if (mode == mode_type::INSERT && std::isprint(c)) {
-			buf.cursor->second.insert(buf.cursor_x, 1, c);
-			buf.cursor_x++;
+		if (mode == mode_type::COMMAND && command_bindings.handle(c, count))
+			break;
+		if (mode == mode_type::INSERT && is_text(c)) {
+			char ch = c;
+			buf->insert(&ch, 1);
+			insertion.typed(&ch, 1);
 			win.update_file();
 			break;
 		}
 		if (mode == mode_type::COMMAND && std::isprint(c)) {
-			char string[] = {(char)c, '\0'};
 			win.command.push_back(c);
-			wprintw(win.cmdline, string);
-			wrefresh(win.cmdline);
+			win.update_cmdline();
 			break;
 		}
-		flash();
+		win.flash();
 	} while (false);
 }
 
+// Handle a key typed by the user, recording it if a macro is being recorded.
+void feed_key(int c)
+{
+	if (macros.recording)
+		macros.registers[macros.recording].push_back(c);
+	dispatch_key(c);
+}
+
+void handle_key()
+{
+	int c = win.input();
+	latency.key = c;
+	iv::scoped_timer timer(latency, iv::phase::DISPATCH);
+	feed_key(c);
+	win.flush();
+}
+
+// key that self-inserts in insert mode
+static bool is_text_key(int c)
+{
+	return is_text(c) && !any_bindings.bindings.count(c) && !insert_bindings.bindings.count(c);
+}
+
+/*
+ * Feed a register through the bindings count times.  Nothing is drawn
+ * until the end, and runs of text typed in insert mode are inserted with
+ * one buffer edit, so replay costs roughly what the edits do.
+ */
+void replay_macro(int reg, int count)
+{
+	if (reg == '@')
+		reg = macros.last;
+	auto it = macros.registers.find(reg);
+	if (it == macros.registers.end())
+		throw std::invalid_argument("register is empty");
+	if (macros.depth >= 100)
+		throw std::runtime_error("macro recursion too deep");
+	macros.last = reg;
+	const std::vector<int> keys = it->second;
+
+	struct replay_guard
+	{
+		replay_guard() { macros.depth++; win.suppressed++; }
+		~replay_guard() { macros.depth--; win.suppressed--; }
+	};
+	{
+		replay_guard guard;
+		std::string text;
+		for (int n = std::max(count, 1); n > 0; n--) {
+			for (size_t i = 0; i < keys.size(); ) {
+				if (mode == mode_type::INSERT && is_text_key(keys[i])) {
+					text.clear();
+					for (; i < keys.size() && is_text_key(keys[i]); i++)
+						text.push_back(keys[i]);
+					buf->insert(text.data(), text.size());
+					insertion.typed(text.data(), text.size());
+				} else {
+					dispatch_key(keys[i++]);
+				}
+			}
+		}
+	}
+	win.update();
+}
+
+/*
+ * Headless ex mode: run the commands against every file, then write it
+ * back if they changed it and did not quit; tabs are kept as they are.
+ * Files are spread over one worker thread per CPU; each thread has its
+ * own buffers, so handle_command() needs no locking.
+ */
+int run_script(const std::vector<std::string> &commands, const std::vector<std::string> &files)
+{
+	expand_tabs = false;
+	std::atomic<size_t> next(0);
+	std::atomic<int> status(0);
+	std::mutex error_mutex;
+	auto worker = [&]() {
+		for (size_t i; (i = next++) < files.size(); ) {
+			try {
+				buffers.clear();
+				buf = NULL;
+				buffer &file = buffers.open(files[i]);
+				try {
+					for (const std::string &command : commands)
+						handle_command(command);
+					buffer &b = buffers.select(file);
+					if (b.modified)
+						b.w();
+				} catch (const quit_request &) {
+				}
+			} catch (const std::exception &exc) {
+				std::lock_guard<std::mutex> lock(error_mutex);
+				std::cerr << files[i] << ": " << exc.what() << std::endl;
+				status = 1;
+			}
+		}
+	};
+	size_t n = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < std::min(n, files.size()); i++)
+		threads.emplace_back(worker);
+	for (std::thread &thread : threads)
+		thread.join();
+	return status;
+}
+
+iv::file_watcher watcher;
+
+// React to changes of the current buffer's file made by someone else.
+void check_file()
+{
+	uint32_t events = watcher.events();
+	if (!events || buf->stale)
+		return;
+	struct stat st;
+	if (::stat(buf->filename.c_str(), &st) != 0 || st.st_ino != buf->inode) {
+		buf->stale = true;
+		win.message(buf->filename + " was replaced, :r to reload");
+	} else if (st.st_size < buf->loaded) {
+		buf->stale = true;
+		win.message(buf->filename + " was truncated, :r to reload");
+	} else if (st.st_size > buf->loaded) {
+		buf->r_tail(st.st_size);
+		if (buf->follow)
+			buf->go_to(buf->chars.size() - 1);
+		win.update_file();
+		win.flush();
+	}
+}
+
+// Block until a key can be read, handling file changes meanwhile.
+void wait_for_input()
+{
+	if (watcher.path() != buf->filename || (!watcher.watching() && !buf->stale))
+		watcher.watch(buf->filename);
+	if (watcher.descriptor() < 0 || win.input_pending())
+		return;
+	while (true) {
+		pollfd fds[] = {{STDIN_FILENO, POLLIN, 0}, {watcher.descriptor(), POLLIN, 0}};
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		if (fds[1].revents)
+			check_file();
+		if (fds[0].revents)
+			return;
+	}
+}
+
+#include "server.cpp"
+
 bool quit_on_sigint = false;
 
 void sigint_handler(int)
@@ -314,12 +1083,62 @@ int main(int argc, char **argv)
 {
 	using namespace std::placeholders;
 
-	signal(SIGINT, sigint_handler);
+	bool headless = false, server = false, client = false;
+	std::vector<std::string> commands;
+	static const option long_options[] = {
+		{"server", no_argument, NULL, 'S'},
+		{"client", no_argument, NULL, 'C'},
+		{NULL, 0, NULL, 0}
+	};
+	for (int opt; (opt = getopt_long(argc, argv, "sc:", long_options, NULL)) != -1; ) {
+		switch (opt) {
+		case 's':
+			headless = true;
+			break;
+		case 'S':
+			server = true;
+			break;
+		case 'C':
+			client = true;
+			break;
+		case 'c':
+			commands.push_back(optarg);
+			break;
+		default:
+			argc = 0;
+			break;
+		}
+	}
 
-	if (argc > 2) {
-		std::cerr << "Usage: " << argv[0] << " [file]" << std::endl;
+	if (argc == 0 || (headless ? optind >= argc : optind < argc - 1) || (server && optind < argc)) {
+		std::cerr << "Usage: " << argv[0] << " [--client] [file]" << std::endl;
+		std::cerr << "       " << argv[0] << " -s [-c command]... file..." << std::endl;
+		std::cerr << "       " << argv[0] << " --server" << std::endl;
 		return 1;
-	} else if (argc < 2){
+	}
+
+	auto map = std::bind(&key_bindings::add_command_binding, &any_bindings, _1, _2);
+	auto nmap = std::bind(&key_bindings::add_command_binding, &normal_bindings, _1, _2);
+	auto imap = std::bind(&key_bindings::add_command_binding, &insert_bindings, _1, _2);
+	auto cmap = std::bind(&key_bindings::add_command_binding, &command_bindings, _1, _2);
+
+#include "config.cpp"
+
+	if (headless) {
+		signal(SIGPIPE, SIG_IGN);
+		return run_script(commands, std::vector<std::string>(argv + optind, argv + argc));
+	}
+	if (server)
+		return run_server();
+	if (client)
+		return run_client(optind < argc ? argv[optind] : "");
+
+	signal(SIGINT, sigint_handler);
+	signal(SIGPIPE, SIG_IGN);
+	win.open();
+	buffers.select(buffers.emplace_back());
+
+	if (optind == argc) {
 		wprintw(win.file, "IV -- simple vi clone");
 		win.update_status();
 	/*} else if (argv[1] == std::string("--dumpkeys")) {
@@ -331,24 +1150,25 @@ int main(int argc, char **argv)
 		}
 		return 0;*/
 	} else {
-		buf.o(argv[1]);
+		buf->o(argv[optind]);
 		win.update();
 	}
-
-	auto map = std::bind(&key_bindings::add_command_binding, &any_bindings, _1, _2);
-	auto nmap = std::bind(&key_bindings::add_command_binding, &normal_bindings, _1, _2);
-	auto imap = std::bind(&key_bindings::add_command_binding, &insert_bindings, _1, _2);
-	auto cmap = std::bind(&key_bindings::add_command_binding, &command_bindings, _1, _2);
-
-#include "config.cpp"
-
+	// -c commands run first, with the same error handling as keys
+	std::deque<std::string> startup(commands.begin(), commands.end());
 	while (true) {
 		try {
+			if (!startup.empty()) {
+				std::string command = startup.front();
+				startup.pop_front();
+				handle_command(command);
+				continue;
+			}
+			wait_for_input();
 			handle_key();
+		} catch (const quit_request &) {
+			return 0;
 		} catch (const std::exception &exc) {
-			wclear(win.status);
-			wprintw(win.status, exc.what());
-			wrefresh(win.status);
+			win.message(exc.what());
 		}
 	}
 }
@@ -0,0 +1,303 @@
+#ifndef IV_LINES_H
+#define IV_LINES_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "memstats.h"
+
+namespace iv
+{
+
+/*
+ * The lines of a buffer, in place of a heap string and a map node per
+ * line.  The text is split into segments: a block holding a run of
+ * consecutive lines back to back, and a table of where each line starts
+ * in it, so a line costs its bytes plus 4.  Its length is where the next
+ * one starts.
+ *
+ * An edit shifts the rest of its segment.  A segment that runs out of room
+ * is split in two, and a segment holding a single line that keeps growing
+ * moves to a block twice its size, so edits touch at most one block.
+ * Views returned by operator [] are good until the next change.
+ */
+class line_store
+{
+	typedef std::vector<uint32_t, counting_allocator<uint32_t, mem::line_index>> start_table;
+	typedef counting_allocator<char, mem::lines> block_allocator;
+
+	struct segment
+	{
+		char *data;
+		uint32_t size;
+		size_t first; // number of the first line
+		start_table starts; // one per line and one for the end of the text
+
+		size_t lines() const { return starts.size() - 1; }
+		uint32_t used() const { return starts.back(); }
+	};
+
+	std::vector<segment> segments;
+	size_t count = 0; // lines
+	size_t reserved = 0; // bytes in blocks
+	mutable size_t hint = 0; // segment of the last lookup
+
+	// Blocks start small and double up to block_size, so small buffers
+	// stay small; a segment is split when its block is full.
+	static const uint32_t first_block_size = 1 << 12;
+	static const uint32_t block_size = 1 << 16;
+
+	// Size of a block for new text.
+	size_t fresh_size() const
+	{
+		return std::clamp<size_t>(reserved, first_block_size, block_size);
+	}
+
+	// An empty segment with a block of size bytes.
+	segment make(size_t size)
+	{
+		if (size > UINT32_MAX)
+			throw std::length_error("line too long");
+		segment s{block_allocator().allocate(size), (uint32_t)size, 0, start_table()};
+		reserved += size;
+		return s;
+	}
+
+	void release(segment &s)
+	{
+		block_allocator().deallocate(s.data, s.size);
+		reserved -= s.size;
+	}
+
+	// Move the text of s to a block of size bytes.
+	void move_block(segment &s, size_t size)
+	{
+		segment t = make(size);
+		std::memcpy(t.data, s.data, s.used());
+		release(s);
+		s.data = t.data;
+		s.size = t.size;
+	}
+
+	// Index of the segment holding line n.
+	size_t find(size_t n) const
+	{
+		if (hint < segments.size() && segments[hint].first <= n && n < segments[hint].first + segments[hint].lines())
+			return hint;
+		auto i = std::upper_bound(segments.begin(), segments.end(), n,
+		                          [](size_t n, const segment &s) { return n < s.first; });
+		return hint = i - segments.begin() - 1;
+	}
+
+	// Fix the line numbers of segment i and those after it.
+	void renumber(size_t i)
+	{
+		size_t first = i ? segments[i - 1].first + segments[i - 1].lines() : 0;
+		for (; i < segments.size(); i++) {
+			segments[i].first = first;
+			first += segments[i].lines();
+		}
+	}
+
+	// Move lines k.. of segment i into a new segment right after it, in a
+	// block of at least size bytes.
+	void split(size_t i, size_t k, size_t size)
+	{
+		segment &s = segments[i];
+		uint32_t from = s.starts[k];
+		segment t = make(std::max<size_t>(size, s.used() - from));
+		std::memcpy(t.data, s.data + from, s.used() - from);
+		t.first = s.first + k;
+		t.starts.reserve(s.starts.size() - k);
+		for (size_t j = k; j < s.starts.size(); j++)
+			t.starts.push_back(s.starts[j] - from);
+		s.starts.resize(k + 1);
+		s.starts.shrink_to_fit();
+		segments.insert(segments.begin() + i + 1, std::move(t));
+	}
+
+	// Join segment i + 1 into segment i if both together are small.
+	void merge(size_t i)
+	{
+		if (i + 1 >= segments.size())
+			return;
+		segment &s = segments[i], &t = segments[i + 1];
+		size_t used = s.used() + t.used();
+		if (used > block_size / 2)
+			return;
+		if (used > s.size)
+			move_block(s, std::min<size_t>(2 * used, block_size));
+		std::memcpy(s.data + s.used(), t.data, t.used());
+		uint32_t base = s.used();
+		s.starts.pop_back();
+		for (uint32_t start : t.starts)
+			s.starts.push_back(base + start);
+		release(t);
+		segments.erase(segments.begin() + i + 1);
+	}
+
+	// Give back most of a block left nearly empty.
+	void trim(segment &s)
+	{
+		if (s.size > 2 * s.used() + 64)
+			move_block(s, s.used() + s.used() / 2 + 64);
+	}
+
+	// Make room for line n to grow by extra bytes.
+	void grow(size_t n, size_t extra)
+	{
+		size_t i = find(n);
+		segment &s = segments[i];
+		size_t k = n - s.first;
+		size_t needed = s.used() + extra;
+		if (s.lines() == 1) {
+			// a long line on its own: move it to a block with room to spare
+			move_block(s, 2 * needed);
+		} else if (k > 0 && k + 1 == s.lines()) {
+			// the last line, as when reading a file: it starts a new block
+			split(i, k, std::max(fresh_size(), 2 * (needed - s.starts[k])));
+		} else {
+			// split where the bytes are halved, leaving room in both
+			auto half = std::lower_bound(s.starts.begin() + 1, s.starts.end() - 2, s.used() / 2);
+			split(i, half - s.starts.begin(), needed);
+		}
+	}
+
+	// Split so that line n starts a segment; returns its index.
+	size_t cut(size_t n)
+	{
+		if (n >= count)
+			return segments.size();
+		size_t i = find(n);
+		size_t k = n - segments[i].first;
+		if (k == 0)
+			return i;
+		split(i, k, 0);
+		trim(segments[i]);
+		return i + 1;
+	}
+
+public:
+	line_store() = default;
+	line_store(const line_store &) = delete;
+	line_store &operator =(const line_store &) = delete;
+	~line_store()
+	{
+		clear();
+	}
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+	std::string_view operator [](size_t n) const
+	{
+		const segment &s = segments[find(n)];
+		size_t k = n - s.first;
+		return std::string_view(s.data + s.starts[k], s.starts[k + 1] - s.starts[k]);
+	}
+
+	std::string_view back() const
+	{
+		return (*this)[count - 1];
+	}
+
+	// Bytes allocated for text and index.
+	size_t memory() const
+	{
+		size_t total = reserved + segments.capacity() * sizeof(segment);
+		for (const segment &s : segments)
+			total += s.starts.capacity() * sizeof(uint32_t);
+		return total;
+	}
+
+	void clear()
+	{
+		for (segment &s : segments)
+			release(s);
+		decltype(segments)().swap(segments);
+		count = 0;
+		hint = 0;
+	}
+
+	// Add an empty line at the end.
+	void push_back()
+	{
+		if (segments.empty()) {
+			segments.push_back(make(fresh_size()));
+			segments.back().starts.push_back(0);
+		}
+		segment &s = segments.back();
+		s.starts.push_back(s.used());
+		count++;
+	}
+
+	// Replace remove bytes at pos of line n with the len bytes of text.
+	void replace(size_t n, size_t pos, size_t remove, const char *text, size_t len)
+	{
+		size_t i = find(n);
+		while (len > remove && segments[i].used() + (len - remove) > segments[i].size) {
+			grow(n, len - remove);
+			i = find(n);
+		}
+		segment &s = segments[i];
+		size_t k = n - s.first;
+		char *p = s.data + s.starts[k];
+		std::memmove(p + pos + len, p + pos + remove, s.used() - s.starts[k] - pos - remove);
+		if (len)
+			std::memcpy(p + pos, text, len);
+		for (size_t j = k + 1; j < s.starts.size(); j++)
+			s.starts[j] = s.starts[j] + len - remove;
+	}
+
+	void insert(size_t n, size_t pos, const char *text, size_t len)
+	{
+		replace(n, pos, 0, text, len);
+	}
+
+	void erase(size_t n, size_t pos, size_t len)
+	{
+		replace(n, pos, len, NULL, 0);
+	}
+
+	void append(size_t n, const char *text, size_t len)
+	{
+		replace(n, (*this)[n].size(), 0, text, len);
+	}
+
+	// Put the lines of other in place of count lines from first.  The
+	// segments of other are taken over, so no text is copied.
+	void splice(size_t first, size_t removed, line_store &other)
+	{
+		// a few lines of output should not bring a mostly empty block
+		if (!other.segments.empty())
+			other.trim(other.segments.back());
+		size_t from = cut(first);
+		size_t to = cut(first + removed);
+		for (size_t i = from; i < to; i++)
+			release(segments[i]);
+		segments.erase(segments.begin() + from, segments.begin() + to);
+		segments.insert(segments.begin() + from, std::make_move_iterator(other.segments.begin()),
+		                std::make_move_iterator(other.segments.end()));
+		reserved += other.reserved;
+		count += other.count - removed;
+		// keep edits in one place from leaving a trail of tiny segments
+		size_t after = from + other.segments.size();
+		merge(after - (after > 0));
+		if (from > 0)
+			merge(from - 1);
+		renumber(from - (from > 0));
+		hint = 0;
+		other.segments.clear();
+		other.reserved = 0;
+		other.clear();
+	}
+};
+
+} // namespace iv
+
+#endif // IV_LINES_H
@@ -0,0 +1,142 @@
+#undef NDEBUG
+#include <cassert>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "lines.h"
+
+// line_store checked against a vector of strings doing the same edits
+struct checked_store
+{
+	iv::line_store store;
+	std::vector<std::string> model;
+
+	void push_back(const std::string &text = "")
+	{
+		store.push_back();
+		store.append(store.size() - 1, text.data(), text.size());
+		model.push_back(text);
+	}
+	void insert(size_t n, size_t pos, const std::string &text)
+	{
+		store.insert(n, pos, text.data(), text.size());
+		model[n].insert(pos, text);
+	}
+	void erase(size_t n, size_t pos, size_t len)
+	{
+		store.erase(n, pos, len);
+		model[n].erase(pos, len);
+	}
+	void splice(size_t first, size_t removed, const std::vector<std::string> &lines)
+	{
+		iv::line_store other;
+		for (const std::string &line : lines) {
+			other.push_back();
+			other.append(other.size() - 1, line.data(), line.size());
+		}
+		store.splice(first, removed, other);
+		assert(other.empty());
+		model.erase(model.begin() + first, model.begin() + first + removed);
+		model.insert(model.begin() + first, lines.begin(), lines.end());
+	}
+	size_t text() const
+	{
+		size_t total = 0;
+		for (const std::string &line : model)
+			total += line.size();
+		return total;
+	}
+	void check() const
+	{
+		assert(store.size() == model.size());
+		assert(store.empty() == model.empty());
+		for (size_t n = 0; n < model.size(); n++)
+			assert(store[n] == model[n]);
+		// backwards too, so lookups cannot lean on the last one
+		for (size_t n = model.size(); n-- > 0; )
+			assert(store[n] == model[n]);
+		if (!model.empty())
+			assert(store.back() == model.back());
+	}
+};
+
+int main()
+{
+	std::cout << "Lines test" << std::endl;
+	{
+		checked_store s;
+		s.check();
+		s.push_back();
+		s.check();
+		s.insert(0, 0, "hello");
+		s.insert(0, 5, " world\n");
+		s.push_back("second\n");
+		s.erase(0, 0, 6);
+		s.check();
+		assert(s.store[0] == "world\n");
+		s.splice(1, 1, {"a\n", "b\n", "c"});
+		s.check();
+		s.splice(0, 4, {});
+		s.check();
+		assert(s.store.empty());
+		s.store.clear();
+		s.model.clear();
+		s.check();
+	}
+	{
+		// a line growing on its own past the size of a block
+		checked_store s;
+		s.push_back();
+		s.push_back("tail");
+		std::string chunk(1000, 'x');
+		for (int i = 0; i < 300; i++)
+			s.insert(0, s.model[0].size() / 2, chunk);
+		s.check();
+		s.erase(0, 10, s.model[0].size() - 20);
+		s.check();
+	}
+	{
+		// reading a file: about four bytes of index per line on top of the text
+		checked_store s;
+		for (int i = 0; i < 500000; i++)
+			s.push_back(std::to_string(i) + "\n");
+		s.check();
+		size_t bound = s.text() + s.text() / 4 + 5 * s.model.size() + 65536;
+		std::printf("%zu lines, %zu bytes of text, %zu allocated\n", s.model.size(), s.text(), s.store.memory());
+		assert(s.store.memory() < bound);
+		s.store.clear();
+		assert(s.store.memory() == 0);
+	}
+	{
+		std::mt19937 rng(1);
+		checked_store s;
+		for (int i = 0; i < 100000; i++) {
+			int op = rng() % 10;
+			if (op == 0 || s.model.empty()) {
+				s.push_back();
+				continue;
+			}
+			size_t n = rng() % s.model.size();
+			size_t pos = rng() % (s.model[n].size() + 1);
+			if (op < 6)
+				s.insert(n, pos, std::string(rng() % (op == 5 ? 300 : 20), 'a' + rng() % 26));
+			else if (op < 9)
+				s.erase(n, pos, rng() % (s.model[n].size() - pos + 1));
+			else {
+				std::vector<std::string> lines;
+				for (int j = rng() % 5; j > 0; j--)
+					lines.push_back(std::string(rng() % 50, 'A' + j));
+				s.splice(n, std::min<size_t>(rng() % 4, s.model.size() - n), lines);
+			}
+			if (i % 5000 == 0)
+				s.check();
+		}
+		s.check();
+		// many small edits must not leave the text scattered over mostly empty blocks
+		std::printf("%zu lines, %zu bytes of text, %zu allocated\n", s.model.size(), s.text(), s.store.memory());
+		assert(s.store.memory() < 3 * s.text() + 65536);
+	}
+	return 0;
+}
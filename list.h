@@ -7,6 +7,7 @@
 #include <iterator>
 #include <memory>
 #include <vector>
+#include "memstats.h"
 #include "simple_ptr.h"
 
 namespace iv
@@ -60,12 +61,22 @@ struct tree : public tree_base<T>
 			this->l->p = this;
 		if (this->r)
 			this->r->p = this;
+		mem::tree_nodes.add(1, sizeof(tree));
+	}
+	~tree()
+	{
+		mem::tree_nodes.sub(1, sizeof(tree));
 	}
 
 	tree *add_min(char x);
 	tree *add_max(char x);
 protected:
 	static tree *balance(tree *l, const T &v, tree *r);
+	// Nodes are never freed: ones replaced by a rebuilt copy are only counted.
+	static void leak(const tree *)
+	{
+		mem::tree_leaked.add(1, sizeof(tree));
+	}
 };
 
 template <class T>
@@ -118,19 +129,23 @@ template <class T>
 tree<T> *tree<T>::balance(tree<T> *l, const T &v, tree<T> *r)
 {
 	if (l->height() > r->height() + 2) {
+		leak(l);
 		if (l->l->height() >= l->r->height()) {
 			auto right = new tree(l->r, v, r);
 			return new tree(l->l, l->v, right);
 		} else {
+			leak(l->r);
 			auto left = new tree(l->l, l->v, l->r->l);
 			auto right = new tree(l->r->r, v, r);
 			return new tree(left, l->r->v, right);
 		}
 	} else if (r->height() > l->height() + 2) {
+		leak(r);
 		if (r->r->height() >= r->l->height()) {
 			auto left = new tree(l, v, r->l);
 			return new tree(left, r->v, r->r);
 		} else {
+			leak(r->l);
 			auto right = new tree(r->l->r, l->v, r->r);
 			auto left = new tree(l, v, r->l->l);
 			return new tree(left, r->l->v, right);
@@ -144,8 +159,8 @@ tree<T> *tree<T>::add_min(char x)
 {
 	if (this == nullptr)
 		return new tree(nullptr, x, nullptr);
-	else
-		return balance(this->l->add_min(x), v, this->r);
+	leak(this);
+	return balance(this->l->add_min(x), v, this->r);
 }
 
 template <class T>
@@ -153,8 +168,8 @@ tree<T> *tree<T>::add_max(char x)
 {
 	if (this == nullptr)
 		return new tree(nullptr, x, nullptr);
-	else
-		return balance(this->l, v, this->r->add_max(x));
+	leak(this);
+	return balance(this->l, v, this->r->add_max(x));
 }
 
 } // namespace iv::internal
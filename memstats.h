@@ -0,0 +1,77 @@
+#ifndef IV_MEMSTATS_H
+#define IV_MEMSTATS_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+namespace iv
+{
+
+// Live object count and byte total of one kind of allocation.
+struct mem_counter
+{
+	const char *name;
+	std::atomic<long> objects;
+	std::atomic<long> bytes;
+
+	void add(long n, long size)
+	{
+		objects.fetch_add(n, std::memory_order_relaxed);
+		bytes.fetch_add(size, std::memory_order_relaxed);
+	}
+	void sub(long n, long size)
+	{
+		add(-n, -size);
+	}
+};
+
+namespace mem
+{
+
+inline mem_counter lines{"lines", {0}, {0}}; // arena blocks holding buffer text
+inline mem_counter line_index{"line_index", {0}, {0}}; // buffer line index entries
+inline mem_counter tree_nodes{"tree_nodes", {0}, {0}}; // iv::internal::tree nodes
+inline mem_counter tree_leaked{"tree_leaked", {0}, {0}}; // tree nodes no longer reachable
+
+inline mem_counter *const all[] = {&lines, &line_index, &tree_nodes, &tree_leaked};
+
+} // namespace iv::mem
+
+// std::allocator that charges everything it hands out to counter C.
+template <class T, mem_counter &C>
+struct counting_allocator
+{
+	typedef T value_type;
+
+	template <class U>
+	struct rebind
+	{
+		typedef counting_allocator<U, C> other;
+	};
+
+	counting_allocator() = default;
+	template <class U>
+	counting_allocator(const counting_allocator<U, C> &) { }
+
+	T *allocate(std::size_t n)
+	{
+		T *p = std::allocator<T>().allocate(n);
+		C.add(1, n * sizeof(T));
+		return p;
+	}
+	void deallocate(T *p, std::size_t n)
+	{
+		C.sub(1, n * sizeof(T));
+		std::allocator<T>().deallocate(p, n);
+	}
+
+	template <class U>
+	bool operator ==(const counting_allocator<U, C> &) const { return true; }
+	template <class U>
+	bool operator !=(const counting_allocator<U, C> &) const { return false; }
+};
+
+} // namespace iv
+
+#endif // IV_MEMSTATS_H
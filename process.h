@@ -0,0 +1,118 @@
+#ifndef IV_PROCESS_H
+#define IV_PROCESS_H
+
+#include <cerrno>
+#include <csignal>
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+namespace iv
+{
+
+/*
+ * "/bin/sh -c command" with its stdin on one pipe and its stdout and
+ * stderr on another.  Both of our ends are non-blocking so the caller can
+ * write and read in one poll() loop without deadlocking on full pipes.
+ * posix_spawn() avoids copying the page tables of a big editor process.
+ */
+class child_process
+{
+	pid_t pid;
+	int in; // child's stdin, -1 once closed
+	int out; // child's stdout, -1 once closed
+
+public:
+	child_process(const std::string &command) : pid(-1), in(-1), out(-1)
+	{
+		int to_child[2], from_child[2];
+		if (pipe2(to_child, O_CLOEXEC) != 0)
+			throw std::runtime_error("pipe failed");
+		if (pipe2(from_child, O_CLOEXEC) != 0) {
+			::close(to_child[0]);
+			::close(to_child[1]);
+			throw std::runtime_error("pipe failed");
+		}
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_init(&actions);
+		posix_spawn_file_actions_adddup2(&actions, to_child[0], 0);
+		posix_spawn_file_actions_adddup2(&actions, from_child[1], 1);
+		posix_spawn_file_actions_adddup2(&actions, from_child[1], 2);
+		// we ignore SIGPIPE, the command should not
+		posix_spawnattr_t attr;
+		posix_spawnattr_init(&attr);
+		sigset_t signals;
+		sigemptyset(&signals);
+		sigaddset(&signals, SIGPIPE);
+		posix_spawnattr_setsigdefault(&attr, &signals);
+		posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+		const char *argv[] = {"sh", "-c", command.c_str(), NULL};
+		int error = posix_spawn(&pid, "/bin/sh", &actions, &attr, const_cast<char **>(argv), environ);
+		posix_spawn_file_actions_destroy(&actions);
+		posix_spawnattr_destroy(&attr);
+		::close(to_child[0]);
+		::close(from_child[1]);
+		if (error) {
+			// no destructor will run to close our ends
+			::close(to_child[1]);
+			::close(from_child[0]);
+			pid = -1;
+			throw std::runtime_error("cannot run /bin/sh");
+		}
+		in = to_child[1];
+		out = from_child[0];
+		fcntl(in, F_SETFL, O_NONBLOCK);
+		fcntl(out, F_SETFL, O_NONBLOCK);
+		// fewer, larger transfers
+		fcntl(in, F_SETPIPE_SZ, 1 << 20);
+		fcntl(out, F_SETPIPE_SZ, 1 << 20);
+	}
+
+	~child_process()
+	{
+		close_input();
+		close_output();
+		wait();
+	}
+
+	child_process(const child_process &) = delete;
+	child_process &operator =(const child_process &) = delete;
+
+	int input() const { return in; }
+	int output() const { return out; }
+
+	void close_input()
+	{
+		if (in >= 0)
+			::close(in);
+		in = -1;
+	}
+
+	void close_output()
+	{
+		if (out >= 0)
+			::close(out);
+		out = -1;
+	}
+
+	// Reap the child; returns its exit status, or -1 if it did not exit.
+	int wait()
+	{
+		if (pid < 0)
+			return -1;
+		int status;
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+			;
+		pid = -1;
+		return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+	}
+};
+
+} // namespace iv
+
+#endif // IV_PROCESS_H
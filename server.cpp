@@ -0,0 +1,622 @@
+/*
+ * Client/server mode.  "iv --server" holds the buffers, "iv --client file"
+ * is a terminal that forwards keys over a Unix domain socket and draws the
+ * rows of the file window that the server reports as changed.
+ *
+ * Every connection gets a reader thread that queues what arrives.  One
+ * writer thread takes requests off the queue and runs them through the
+ * same feed_key() the local editor uses, with the client's mode, command
+ * line and cursor swapped into the globals, so editing needs no locks and
+ * a file opened by several clients is loaded only once.  Replies go
+ * through a per-connection outbox and sender thread, so a client that
+ * stops reading (suspended with ^Z, say) stalls only itself.
+ *
+ * A message is a type byte, a 32 bit payload length and the payload.
+ */
+
+namespace remote
+{
+
+enum message_type : uint8_t {
+	HELLO,   // client: rows of its file window (int32)
+	OPEN,    // client: absolute file name, empty for a new buffer
+	KEY,     // client: key (int32)
+	LINE,    // server: row (int32) followed by the text shown there
+	CURSOR,  // server: row and column (int32 each) in the file window
+	STATUS,  // server: status line
+	CMDLINE, // server: command line
+	END,     // server: end of an update, time to refresh the terminal
+	QUIT     // server: the client quit
+};
+
+/*
+ * Whoever can connect can type into the server, and :r !cmd runs shell
+ * commands, so the socket lives in a directory only we can enter:
+ * $XDG_RUNTIME_DIR, or /tmp/iv-<uid> created with mode 0700.  Both ends
+ * also check the other's uid with SO_PEERCRED.
+ */
+std::string socket_path()
+{
+	if (const char *path = std::getenv("IV_SOCKET"))
+		return path;
+	std::string dir;
+	if (const char *runtime = std::getenv("XDG_RUNTIME_DIR")) {
+		dir = runtime;
+	} else {
+		dir = "/tmp/iv-" + std::to_string(geteuid());
+		if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST)
+			throw std::runtime_error(dir + ": " + std::strerror(errno));
+	}
+	struct stat st;
+	if (lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 077))
+		throw std::runtime_error(dir + " is not a directory private to this user");
+	return dir + "/iv.sock";
+}
+
+static bool same_user(int fd)
+{
+	ucred cred;
+	socklen_t size = sizeof(cred);
+	return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &size) == 0 && cred.uid == geteuid();
+}
+
+static void put_int(std::string &out, int32_t v)
+{
+	out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+static int32_t get_int(const std::string &in, size_t pos)
+{
+	int32_t v = 0;
+	if (pos + sizeof(v) <= in.size())
+		std::memcpy(&v, in.data() + pos, sizeof(v));
+	return v;
+}
+
+static void append(std::string &out, message_type type, const std::string &payload)
+{
+	out.push_back(type);
+	put_int(out, payload.size());
+	out += payload;
+}
+
+static bool write_all(int fd, const std::string &data)
+{
+	for (size_t done = 0; done < data.size(); ) {
+		ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		done += n;
+	}
+	return true;
+}
+
+static bool read_all(int fd, char *data, size_t size)
+{
+	for (size_t done = 0; done < size; ) {
+		ssize_t n = ::read(fd, data + done, size - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		done += n;
+	}
+	return true;
+}
+
+static bool receive(int fd, message_type &type, std::string &payload)
+{
+	char header[5];
+	if (!read_all(fd, header, sizeof(header)))
+		return false;
+	type = (message_type)header[0];
+	uint32_t size;
+	std::memcpy(&size, header + 1, sizeof(size));
+	if (size > (64u << 20))
+		return false;
+	payload.resize(size);
+	return read_all(fd, &payload[0], size);
+}
+
+static sockaddr_un address(const std::string &path)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		throw std::invalid_argument("socket path too long: " + path);
+	std::strcpy(addr.sun_path, path.c_str());
+	return addr;
+}
+
+static int connect_socket(const std::string &path)
+{
+	sockaddr_un addr = address(path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd >= 0 && connect(fd, (const sockaddr *)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+// Editor state that belongs to one terminal rather than to the buffers.
+struct client
+{
+	int fd;
+	int rows = 1;
+	buffer *b = NULL;
+	int cursor_line = 0, start_line = 0;
+	size_t cursor_x = 0;
+	mode_type mode = mode_type::NORMAL;
+	std::string command;
+	int count_prefix = 0;
+	change last_change;
+	insert_state insertion;
+	int recording = 0;
+	std::function<void (int)> pending_key;
+	bool quit = false;
+
+	// what the client currently shows, so that only changes are sent
+	std::vector<std::string> screen;
+	std::string status, cmdline;
+	int cursor_row = -1, cursor_col = -1;
+	// output of the request being handled
+	std::string message;
+	std::vector<std::string> report;
+
+	// replies not yet written; a client this far behind is dropped
+	static const size_t outbox_limit = 16 << 20;
+	std::mutex outbox_mutex;
+	std::condition_variable outbox_ready;
+	std::string outbox;
+	bool closing = false; // send what is left, then hang up
+
+	client(int _fd) : fd(_fd) { }
+	~client()
+	{
+		close(fd);
+	}
+
+	// Queue data for the sender; false if the client fell too far behind.
+	bool send(const std::string &data)
+	{
+		std::lock_guard<std::mutex> lock(outbox_mutex);
+		if (outbox.size() + data.size() > outbox_limit)
+			return false;
+		outbox += data;
+		outbox_ready.notify_one();
+		return true;
+	}
+
+	void hang_up()
+	{
+		std::lock_guard<std::mutex> lock(outbox_mutex);
+		closing = true;
+		outbox_ready.notify_one();
+	}
+};
+
+struct request
+{
+	std::shared_ptr<client> from;
+	message_type type;
+	std::string payload;
+	bool detach; // the connection is gone
+};
+
+// Requests of all clients, in arrival order, for the single writer.
+class request_queue
+{
+	std::mutex mutex;
+	std::condition_variable ready;
+	std::deque<request> requests;
+public:
+	void push(request r)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			requests.push_back(std::move(r));
+		}
+		ready.notify_one();
+	}
+	request pop()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		ready.wait(lock, [this]() { return !requests.empty(); });
+		request r = std::move(requests.front());
+		requests.pop_front();
+		return r;
+	}
+};
+
+static void swap_state(client &c)
+{
+	std::swap(mode, c.mode);
+	std::swap(win.command, c.command);
+	std::swap(count_prefix, c.count_prefix);
+	std::swap(last_change, c.last_change);
+	std::swap(insertion, c.insertion);
+	std::swap(pending_key, c.pending_key);
+	std::swap(macros.recording, c.recording);
+}
+
+// Make c's buffer, cursor and modes the current ones.  If its buffer
+// cannot be brought back, there is none until the next request.
+static void enter(client &c)
+{
+	swap_state(c);
+	view_lines = c.rows;
+	buf = c.b;
+	if (!buf)
+		return;
+	try {
+		buffers.select(*buf);
+	} catch (...) {
+		buf = NULL;
+		throw;
+	}
+	buf->start = std::min(c.start_line, (int)buf->chars.size() - 1);
+	buf->cursor_x = c.cursor_x;
+	buf->go_to(c.cursor_line);
+}
+
+static void leave(client &c)
+{
+	if (buf) {
+		c.b = buf;
+		c.cursor_line = buf->cursor;
+		c.start_line = buf->start;
+		c.cursor_x = buf->cursor_x;
+	}
+	view_lines = 0;
+	swap_state(c);
+}
+
+// The messages that bring c's terminal up to date.
+static std::string render(client &c)
+{
+	std::string out, payload;
+	// without a buffer (the file could not be opened) there is only status
+	if (buf) {
+		c.screen.resize(c.rows);
+		int line = buf->start;
+		for (int row = 0; row < c.rows; row++) {
+			std::string text;
+			if (!c.report.empty()) {
+				if (row < (int)c.report.size())
+					text = c.report[row];
+			} else if (line < (int)buf->chars.size()) {
+				text = buf->chars[line];
+				if (!text.empty() && text.back() == '\n')
+					text.pop_back();
+				++line;
+			}
+			if (text != c.screen[row]) {
+				payload.clear();
+				put_int(payload, row);
+				payload += text;
+				append(out, LINE, payload);
+				c.screen[row].swap(text);
+			}
+		}
+		c.report.clear();
+
+		int row = buf->cursor - buf->start;
+		int col = buf->cursor_column();
+		if (row != c.cursor_row || col != c.cursor_col) {
+			payload.clear();
+			put_int(payload, row);
+			put_int(payload, col);
+			append(out, CURSOR, payload);
+			c.cursor_row = row;
+			c.cursor_col = col;
+		}
+	}
+
+	std::string status = c.message.empty() && buf ? win.status_text() : c.message;
+	if (status != c.status)
+		append(out, STATUS, c.status = status);
+	std::string cmdline = mode == mode_type::COMMAND ? ":" + win.command : std::string();
+	if (cmdline != c.cmdline)
+		append(out, CMDLINE, c.cmdline = cmdline);
+	append(out, END, std::string());
+	return out;
+}
+
+static void open_file(const std::string &filename)
+{
+	if (filename.empty()) {
+		buffers.select(buffers.emplace_back());
+		return;
+	}
+	try {
+		buffers.open(filename);
+	} catch (const std::exception &) {
+		if (::access(filename.c_str(), F_OK) == 0 || errno != ENOENT)
+			throw;
+		// like vi, start a new file that :w will create
+		buffers.select(buffers.emplace_back()).filename = filename;
+		win.message(filename + " [New File]");
+	}
+}
+
+// Queue out for c, dropping c if it fell too far behind.
+static void deliver(client &c, const std::string &out)
+{
+	if (!c.send(out)) {
+		c.quit = true;
+		shutdown(c.fd, SHUT_RDWR); // unblocks its sender and reader
+	}
+	if (c.quit)
+		c.hang_up();
+}
+
+// Bring the other clients showing c's buffer up to date with its edits.
+static void update_others(client &c, const std::vector<std::shared_ptr<client>> &clients)
+{
+	std::string nothing;
+	append(nothing, END, std::string());
+	for (const std::shared_ptr<client> &other : clients) {
+		if (other.get() == &c || other->b != c.b || other->quit)
+			continue;
+		enter(*other);
+		std::string out = render(*other);
+		leave(*other);
+		if (out != nothing)
+			deliver(*other, out);
+	}
+}
+
+// The writer: applies requests one at a time and answers with screen diffs.
+static void serve(request_queue &queue)
+{
+	std::vector<std::shared_ptr<client>> clients; // connected, for update_others()
+	client *current = NULL;
+	win.on_message = [&current](const std::string &text) { current->message = text; };
+	win.on_report = [&current](const std::vector<std::string> &lines) { current->report = lines; };
+	while (true) {
+		request r = queue.pop();
+		client &c = *r.from;
+		if (r.detach) {
+			clients.erase(std::remove(clients.begin(), clients.end(), r.from), clients.end());
+			c.hang_up();
+			continue;
+		}
+		if (r.type == HELLO && std::find(clients.begin(), clients.end(), r.from) == clients.end())
+			clients.push_back(r.from);
+		if (c.quit)
+			continue;
+		current = &c;
+		c.message.clear();
+		std::string out;
+		try {
+			enter(c);
+			switch (r.type) {
+			case HELLO:
+				c.rows = view_lines = std::max(get_int(r.payload, 0), 1);
+				break;
+			case OPEN:
+				open_file(r.payload);
+				break;
+			case KEY:
+				if (!buf)
+					throw std::runtime_error("no buffer, the file could not be opened");
+				feed_key(get_int(r.payload, 0));
+				break;
+			default:
+				break;
+			}
+		} catch (const quit_request &) {
+			c.quit = true;
+		} catch (const std::exception &exc) {
+			c.message = exc.what();
+		}
+		if (c.quit)
+			append(out, QUIT, std::string());
+		else
+			out = render(c);
+		leave(c);
+		deliver(c, out);
+		if (c.b)
+			update_others(c, clients);
+	}
+}
+
+static void send_replies(std::shared_ptr<client> c)
+{
+	std::string data;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(c->outbox_mutex);
+			c->outbox_ready.wait(lock, [&c]() { return !c->outbox.empty() || c->closing; });
+			if (c->outbox.empty())
+				break;
+			data.swap(c->outbox);
+		}
+		if (!write_all(c->fd, data))
+			break;
+		data.clear();
+	}
+	shutdown(c->fd, SHUT_RDWR);
+}
+
+static void read_requests(std::shared_ptr<client> c, request_queue &queue)
+{
+	message_type type;
+	std::string payload;
+	while (receive(c->fd, type, payload))
+		queue.push(request{c, type, std::move(payload), false});
+	queue.push(request{c, QUIT, std::string(), true});
+}
+
+static std::string listening_path;
+
+static void remove_socket(int)
+{
+	unlink(listening_path.c_str());
+	_exit(0);
+}
+
+} // namespace remote
+
+int run_server()
+{
+	using namespace remote;
+	// wcwidth() needs the locale to know the width of non-ASCII text;
+	// the local editor sets it when opening the terminal
+	std::setlocale(LC_ALL, "");
+	std::string path;
+	try {
+		path = socket_path();
+	} catch (const std::exception &exc) {
+		std::cerr << exc.what() << std::endl;
+		return 1;
+	}
+	int fd = connect_socket(path);
+	if (fd >= 0) {
+		std::cerr << "a server is already listening on " << path << std::endl;
+		close(fd);
+		return 1;
+	}
+	unlink(path.c_str());
+	sockaddr_un addr = address(path);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || bind(fd, (const sockaddr *)&addr, sizeof(addr)) != 0
+	    || chmod(path.c_str(), 0600) != 0 || listen(fd, 16) != 0) {
+		std::cerr << path << ": " << std::strerror(errno) << std::endl;
+		return 1;
+	}
+	listening_path = path;
+	signal(SIGINT, remove_socket);
+	signal(SIGTERM, remove_socket);
+	signal(SIGPIPE, SIG_IGN);
+
+	request_queue queue;
+	std::thread(serve, std::ref(queue)).detach();
+	while (true) {
+		int client_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+		if (client_fd < 0) {
+			if (errno == EINTR)
+				continue;
+			std::cerr << "accept: " << std::strerror(errno) << std::endl;
+			return 1;
+		}
+		if (!same_user(client_fd)) {
+			close(client_fd);
+			continue;
+		}
+		auto c = std::make_shared<client>(client_fd);
+		std::thread(send_replies, c).detach();
+		std::thread(read_requests, c, std::ref(queue)).detach();
+	}
+}
+
+// Terminal side: forward keys, draw what the server sends.
+int run_client(const std::string &file)
+{
+	using namespace remote;
+	std::string path;
+	try {
+		path = socket_path();
+	} catch (const std::exception &exc) {
+		std::cerr << exc.what() << std::endl;
+		return 1;
+	}
+	int fd = connect_socket(path);
+	if (fd < 0) {
+		std::cerr << "cannot connect to " << path << ": " << std::strerror(errno) << std::endl;
+		return 1;
+	}
+	// keys must not go to a server someone else left listening there
+	if (!same_user(fd)) {
+		std::cerr << path << " belongs to another user" << std::endl;
+		return 1;
+	}
+	std::string filename = file;
+	if (char *real = realpath(file.c_str(), NULL)) {
+		filename = real;
+		std::free(real);
+	}
+
+	win.open();
+	std::string out, payload;
+	put_int(payload, LINES - 2);
+	append(out, HELLO, payload);
+	append(out, OPEN, filename);
+	if (!write_all(fd, out))
+		return 1;
+
+	int cursor_row = 0, cursor_col = 0;
+	std::string cmdline;
+	while (true) {
+		pollfd fds[] = {{STDIN_FILENO, POLLIN, 0}, {fd, POLLIN, 0}};
+		// a key ncurses read ahead is not seen by poll()
+		if (win.input_pending())
+			fds[0].revents = POLLIN;
+		else if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[0].revents) {
+			payload.clear();
+			put_int(payload, win.input());
+			out.clear();
+			append(out, KEY, payload);
+			if (!write_all(fd, out))
+				break;
+		}
+		if (!fds[1].revents)
+			continue;
+		message_type type;
+		if (!receive(fd, type, payload))
+			break;
+		switch (type) {
+		case LINE: {
+			const char *text = payload.c_str() + 4;
+			size_t size = payload.size() - 4;
+			wmove(win.file, get_int(payload, 0), 0);
+			wclrtoeol(win.file);
+			if (iv::utf8::is_ascii(text, size))
+				waddnstr(win.file, text, std::min<size_t>(size, COLS));
+			else
+				waddnstr(win.file, text, iv::utf8::clip(text, size, COLS));
+			break;
+		}
+		case CURSOR:
+			cursor_row = get_int(payload, 0);
+			cursor_col = get_int(payload, 4);
+			break;
+		case STATUS:
+			werase(win.status);
+			waddstr(win.status, payload.c_str());
+			break;
+		case CMDLINE:
+			cmdline = payload;
+			werase(win.cmdline);
+			waddstr(win.cmdline, cmdline.c_str());
+			break;
+		case END:
+			wnoutrefresh(win.status);
+			if (cmdline.empty()) {
+				wnoutrefresh(win.cmdline);
+				wmove(win.file, cursor_row, cursor_col);
+				wnoutrefresh(win.file);
+			} else {
+				wnoutrefresh(win.file);
+				wnoutrefresh(win.cmdline);
+			}
+			doupdate();
+			break;
+		case QUIT:
+			return 0;
+		default:
+			break;
+		}
+	}
+	endwin();
+	std::cerr << "lost connection to " << path << std::endl;
+	return 1;
+}
@@ -0,0 +1,207 @@
+#ifndef IV_STATS_H
+#define IV_STATS_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace iv
+{
+
+// Log-linear histogram in the spirit of HdrHistogram: values below
+// 2^sub_bits are kept exactly, larger ones with sub_bits of precision
+// (about 6% relative error).  Recording is a couple of shifts and an
+// increment, so it can stay on all the time.
+class histogram
+{
+	static const int sub_bits = 4;
+	static const int sub_count = 1 << sub_bits;
+	uint64_t counts[(64 - sub_bits + 1) * sub_count] = {};
+	uint64_t total = 0;
+	uint64_t max_value = 0;
+
+	static int index(uint64_t v)
+	{
+		if (v < sub_count)
+			return v;
+		int e = 63 - __builtin_clzll(v);
+		return (e - sub_bits + 1) * sub_count + ((v >> (e - sub_bits)) & (sub_count - 1));
+	}
+
+	// lowest value that falls into bucket i
+	static uint64_t lowest(int i)
+	{
+		if (i < sub_count)
+			return i;
+		int e = i / sub_count + sub_bits - 1;
+		return (uint64_t(1) << e) | (uint64_t(i % sub_count) << (e - sub_bits));
+	}
+
+public:
+	void record(uint64_t v)
+	{
+		counts[index(v)]++;
+		total++;
+		if (v > max_value)
+			max_value = v;
+	}
+
+	uint64_t count() const { return total; }
+	uint64_t max() const { return max_value; }
+
+	// value at or below which the fraction p of the recorded values lie
+	uint64_t percentile(double p) const
+	{
+		if (total == 0)
+			return 0;
+		uint64_t rank = p * total;
+		if (rank < 1)
+			rank = 1;
+		uint64_t seen = 0;
+		for (int i = 0; i < (int)(sizeof(counts) / sizeof(*counts)); i++) {
+			seen += counts[i];
+			if (seen >= rank)
+				return std::min(lowest(i + 1) - 1, max_value);
+		}
+		return max_value;
+	}
+};
+
+enum class phase : uint32_t {
+	DISPATCH, // whole keystroke, from wgetch() returning to the next wait
+	MUTATE,   // changing buffer text
+	RENDER,   // redrawing the file window
+	REFRESH,  // doupdate(), i.e. writing to the terminal
+	COUNT
+};
+
+static const char *const phase_names[] = {"dispatch", "mutate", "render", "refresh"};
+
+/*
+ * Per-keystroke latency accounting.  Every phase gets its own histogram,
+ * every command executed through handle_command() its own counter.
+ *
+ * If the IV_TRACE environment variable names a file, each sample is also
+ * kept in memory and written there on exit as a flat array of
+ * trace_event records preceded by the 8 byte magic "IVTRACE1".
+ */
+class latency_recorder
+{
+public:
+	typedef std::chrono::steady_clock clock;
+
+	struct trace_event
+	{
+		uint64_t start; // ns since startup
+		uint64_t duration; // ns
+		uint32_t phase;
+		int32_t key; // key being handled, -1 if unknown
+	};
+
+private:
+	histogram phases[(int)phase::COUNT];
+	std::map<std::string, uint64_t> commands;
+	clock::time_point epoch;
+	std::string trace_path;
+	std::vector<trace_event> trace;
+
+public:
+	int key = -1; // key currently being dispatched
+
+	// All threads share one epoch so their traces line up.
+	latency_recorder() : epoch(process_start())
+	{
+		if (const char *path = std::getenv("IV_TRACE"))
+			trace_path = path;
+	}
+
+	// Every thread has a recorder (-s runs one per worker); the first
+	// to finish creates the trace file and the others append to it.
+	~latency_recorder()
+	{
+		if (trace.empty())
+			return;
+		static std::mutex file_mutex;
+		static bool started = false;
+		std::lock_guard<std::mutex> lock(file_mutex);
+		if (FILE *f = std::fopen(trace_path.c_str(), started ? "ab" : "wb")) {
+			if (!started)
+				std::fwrite("IVTRACE1", 1, 8, f);
+			started = true;
+			std::fwrite(trace.data(), sizeof(trace_event), trace.size(), f);
+			std::fclose(f);
+		}
+	}
+
+	static clock::time_point process_start()
+	{
+		static const clock::time_point start = clock::now();
+		return start;
+	}
+
+	void record(phase p, clock::time_point begin, clock::time_point end)
+	{
+		uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+		phases[(int)p].record(ns);
+		if (!trace_path.empty()) {
+			uint64_t start = std::chrono::duration_cast<std::chrono::nanoseconds>(begin - epoch).count();
+			trace.push_back(trace_event{start, ns, (uint32_t)p, key});
+		}
+	}
+
+	void count_command(const std::string &name)
+	{
+		commands[name]++;
+	}
+
+	const histogram &operator [](phase p) const
+	{
+		return phases[(int)p];
+	}
+
+	const std::map<std::string, uint64_t> &command_counts() const
+	{
+		return commands;
+	}
+};
+
+// Records the lifetime of the object as one sample of the given phase.
+class scoped_timer
+{
+	latency_recorder &recorder;
+	phase p;
+	latency_recorder::clock::time_point begin;
+public:
+	scoped_timer(latency_recorder &_recorder, phase _p)
+		: recorder(_recorder), p(_p), begin(latency_recorder::clock::now())
+	{
+	}
+	~scoped_timer()
+	{
+		recorder.record(p, begin, latency_recorder::clock::now());
+	}
+};
+
+inline std::string format_duration(uint64_t ns)
+{
+	char s[32];
+	if (ns < 1000)
+		std::snprintf(s, sizeof(s), "%lluns", (unsigned long long)ns);
+	else if (ns < 1000000)
+		std::snprintf(s, sizeof(s), "%.1fus", ns / 1e3);
+	else if (ns < 1000000000)
+		std::snprintf(s, sizeof(s), "%.1fms", ns / 1e6);
+	else
+		std::snprintf(s, sizeof(s), "%.2fs", ns / 1e9);
+	return s;
+}
+
+} // namespace iv
+
+#endif // IV_STATS_H
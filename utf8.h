@@ -0,0 +1,135 @@
+#ifndef IV_UTF8_H
+#define IV_UTF8_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace iv
+{
+
+namespace utf8
+{
+
+// True if no byte has the high bit set.  Lines are or'ed together 16
+// bytes at a time, so the common all-ASCII case costs almost nothing.
+inline bool is_ascii(const char *s, size_t n)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	__m128i acc = _mm_setzero_si128();
+	for (; i + 16 <= n; i += 16)
+		acc = _mm_or_si128(acc, _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i)));
+	if (_mm_movemask_epi8(acc))
+		return false;
+#endif
+	uint64_t word = 0;
+	for (; i + 8 <= n; i += 8) {
+		uint64_t w;
+		std::memcpy(&w, s + i, 8);
+		word |= w;
+	}
+	for (; i < n; i++)
+		word |= (unsigned char)s[i];
+	return !(word & 0x8080808080808080ull);
+}
+
+inline bool is_continuation(char c)
+{
+	return (c & 0xc0) == 0x80;
+}
+
+// Decode the character at s, returning its length in bytes.  Malformed
+// input decodes as U+FFFD one byte at a time.
+inline size_t decode(const char *s, size_t n, char32_t &c)
+{
+	unsigned char b = s[0];
+	size_t len = b < 0x80 ? 1 : b < 0xc2 ? 0 : b < 0xe0 ? 2 : b < 0xf0 ? 3 : b < 0xf5 ? 4 : 0;
+	if (len == 1) {
+		c = b;
+		return 1;
+	}
+	if (len == 0 || len > n) {
+		c = 0xfffd;
+		return 1;
+	}
+	c = b & (0x7f >> len);
+	for (size_t i = 1; i < len; i++) {
+		if (!is_continuation(s[i])) {
+			c = 0xfffd;
+			return 1;
+		}
+		c = (c << 6) | (s[i] & 0x3f);
+	}
+	return len;
+}
+
+// Columns the character takes on the terminal.  wcwidth() knows the East
+// Asian wide and the zero width ranges and is what ncursesw itself uses;
+// control characters are drawn as ^X.
+inline int width(char32_t c)
+{
+	if (c == '\n')
+		return 0;
+	if (c < 0x20 || c == 0x7f)
+		return 2;
+	if (c < 0x7f)
+		return 1;
+	int w = ::wcwidth(c);
+	return w < 0 ? 1 : w;
+}
+
+// Display width of the first n bytes of s.
+inline int columns(const char *s, size_t n)
+{
+	int cols = 0;
+	char32_t c;
+	for (size_t i = 0; i < n; ) {
+		i += decode(s + i, n - i, c);
+		cols += width(c);
+	}
+	return cols;
+}
+
+// Number of leading bytes of s that fit into cols columns.
+inline size_t clip(const char *s, size_t n, int cols)
+{
+	size_t i = 0;
+	char32_t c;
+	while (i < n) {
+		size_t len = decode(s + i, n - i, c);
+		if ((cols -= width(c)) < 0)
+			break;
+		i += len;
+	}
+	return i;
+}
+
+// Start of the character after / before the one at byte i.
+inline size_t next(const char *s, size_t n, size_t i)
+{
+	if (i < n)
+		i++;
+	while (i < n && is_continuation(s[i]))
+		i++;
+	return i;
+}
+
+inline size_t prev(const char *s, size_t i)
+{
+	if (i > 0)
+		i--;
+	while (i > 0 && is_continuation(s[i]))
+		i--;
+	return i;
+}
+
+} // namespace iv::utf8
+
+} // namespace iv
+
+#endif // IV_UTF8_H
@@ -0,0 +1,72 @@
+#ifndef IV_WATCH_H
+#define IV_WATCH_H
+
+#include <cstdint>
+#include <string>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace iv
+{
+
+// Watches a single file through inotify.  The descriptor is non-blocking
+// so it can be polled together with the terminal.
+class file_watcher
+{
+	int fd;
+	int wd;
+	std::string file;
+public:
+	file_watcher() : fd(-1), wd(-1) { }
+	~file_watcher()
+	{
+		if (fd >= 0)
+			close(fd);
+	}
+	file_watcher(const file_watcher &) = delete;
+	file_watcher &operator =(const file_watcher &) = delete;
+
+	const std::string &path() const { return file; }
+	int descriptor() const { return fd; }
+	bool watching() const { return wd >= 0; }
+
+	// Start watching path, replacing the previous watch.  A file that
+	// cannot be watched (e.g. does not exist yet) is silently skipped.
+	void watch(const std::string &path)
+	{
+		if (wd >= 0)
+			inotify_rm_watch(fd, wd);
+		wd = -1;
+		file = path;
+		if (file.empty())
+			return;
+		if (fd < 0)
+			fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (fd >= 0)
+			wd = inotify_add_watch(fd, file.c_str(), IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+	}
+
+	// Drain the queued events and return their masks or'ed together.
+	uint32_t events()
+	{
+		uint32_t mask = 0;
+		alignas(inotify_event) char data[4096];
+		ssize_t n;
+		while (fd >= 0 && (n = read(fd, data, sizeof(data))) > 0) {
+			for (char *p = data; p < data + n; ) {
+				const inotify_event *event = reinterpret_cast<const inotify_event *>(p);
+				if (event->wd == wd) {
+					mask |= event->mask;
+					if (event->mask & IN_IGNORED)
+						wd = -1;
+				}
+				p += sizeof(inotify_event) + event->len;
+			}
+		}
+		return mask;
+	}
+};
+
+} // namespace iv
+
+#endif // IV_WATCH_H